@@ -0,0 +1,13 @@
+#!/bin/sh
+# SPDX-License-Identifier: GPL-3.0-or-later
+#
+# Compile speed: time how long it takes to parse and assemble a program
+# from bench/gensrc.sh, made of words built from the immediate words
+# (define, const, if, while, ...). Each run of this kernel produces a
+# single sample so bench/run.sh runs it repeatedly.
+
+echo "us r6"
+sh "$(dirname "$0")/gensrc.sh" 200 6
+echo "us r7"
+echo "sub r0, r7, r6"
+echo "print r0"
@@ -0,0 +1,60 @@
+#!/bin/sh
+# SPDX-License-Identifier: GPL-3.0-or-later
+#
+# Generate a large synthetic program for measuring compile throughput:
+#
+#   sh bench/gensrc.sh [WORDS [DEPTH]] | ./eigth --stats > /dev/null
+#
+# Each word has its own constant and a body of alternately nested if and
+# while blocks DEPTH levels deep. The innermost block refers to constants
+# and calls words defined earlier so that the symbol table gets searched
+# at every depth. The generated words are only compiled, never run.
+
+words=${1:-1000}
+depth=${2:-8}
+
+awk -v words="$words" -v depth="$depth" '
+function indent(level) {
+	return sprintf("%" (2 * level + 2) "s", "")
+}
+
+function nest(i, level, loops,    pad, r) {
+	pad = indent(level)
+	if (level == depth) {
+		j = int(rand() * i)
+		printf "%sadd r2, r2, K%d\n", pad, j
+		printf "%sw%d r2, r1\n", pad, j
+		return
+	}
+	if (level % 2) {
+		r = 3 + loops % 5
+		printf "%smov r%d, %d\n", pad, r, level + 1
+		printf "%swhile r%d\n", pad, r
+		nest(i, level + 1, loops + 1)
+		printf "%s  sub r%d, r%d, 1\n", pad, r, r
+		printf "%send\n", pad
+	} else {
+		printf "%sif r1 >= r2\n", pad
+		nest(i, level + 1, loops)
+		printf "%selse\n", pad
+		printf "%s  xor r2, r2, r1\n", pad
+		printf "%send\n", pad
+	}
+}
+
+BEGIN {
+	srand(8)
+	print "# generated by bench/gensrc.sh " words " " depth
+	print ""
+	for (i = 0; i < words; i++) {
+		if (i > 0)
+			print ""
+		printf "const K%d %d\n", i, (i * 7919) % 1000
+		printf "define\n  w%d r0, r1\n", i
+		printf "  use r2, r3, r4, r5\n  use r6, r7\nbegin\n"
+		printf "  mov r2, K%d\n", i
+		if (i > 0)
+			nest(i, 0, 0)
+		printf "  add r0, r0, r2\nend\n"
+	}
+}'
@@ -0,0 +1,153 @@
+#!/bin/sh
+# SPDX-License-Identifier: GPL-3.0-or-later
+#
+# Run the benchmark kernels and report the median, 90th percentile and
+# standard deviation of their timings (in microseconds).
+#
+# Each kernel prints one timing per line. Kernels that loop are told how
+# many timings to take via ITERATIONS, kernels that cannot (because they
+# time the compiler itself) print a single timing and are run repeatedly.
+# Either way the first few timings are treated as warm up and discarded.
+#
+# A kernel is either a .8th file or a .8th.sh script that generates one
+# (so that large inputs do not have to be kept in the tree).
+#
+# Results can be saved as JSON and a later run compared against them;
+# any kernel whose median has slowed down by more than the threshold is
+# reported as a regression and the script exits with a non-zero status.
+
+usage() {
+	cat <<EOF
+Usage: $0 [options] [kernel.8th ...]
+
+  -n N      take N samples of each kernel (default: $samples)
+  -w N      discard N warm up samples first (default: $warmup)
+  -j FILE   write the results to FILE as JSON
+  -b FILE   compare the results against a baseline JSON file
+  -t PCT    regression threshold in percent (default: $threshold)
+  -B NAME   run the kernels using the NAME backend (vm, native or tiered)
+
+The eigth binary is taken from \$EIGTH (default: ./eigth).
+EOF
+	exit 2
+}
+
+dir=$(dirname "$0")
+eigth=${EIGTH:-./eigth}
+samples=15
+warmup=3
+json=
+baseline=
+threshold=10
+flags=
+
+while getopts n:w:j:b:t:B:h opt; do
+	case $opt in
+	n) samples=$OPTARG ;;
+	w) warmup=$OPTARG ;;
+	j) json=$OPTARG ;;
+	b) baseline=$OPTARG ;;
+	t) threshold=$OPTARG ;;
+	B) flags=--backend=$OPTARG ;;
+	*) usage ;;
+	esac
+done
+shift $((OPTIND - 1))
+[ $# -eq 0 ] && set -- "$dir"/*.8th "$dir"/*.8th.sh
+
+tmp=$(mktemp) || exit 1
+trap 'rm -f "$tmp" "$tmp.raw" "$tmp.samples"' EXIT
+
+# program FILE: print the program for a kernel
+program() {
+	case $1 in
+	*.sh) sh "$1" ;;
+	*) cat "$1" ;;
+	esac
+}
+
+# collect FILE: print the post warm up timings for a kernel
+collect() {
+	want=$((warmup + samples))
+	: > "$tmp.raw"
+	have=0
+	while [ "$have" -lt "$want" ]; do
+		{ echo "const ITERATIONS $want"; program "$1"; } | "$eigth" $flags >> "$tmp.raw" ||
+			{ echo "$1: eigth failed" >&2; exit 1; }
+		got=$(wc -l < "$tmp.raw")
+		[ "$got" -gt "$have" ] ||
+			{ echo "$1: no timings reported" >&2; exit 1; }
+		have=$got
+	done
+	sed -n "$((warmup + 1)),${want}p" "$tmp.raw"
+}
+
+for k in "$@"; do
+	name=$(basename "${k%.sh}" .8th)
+	collect "$k" > "$tmp.samples"
+	sort -n "$tmp.samples" | awk -v name="$name" '
+		{ v[NR] = $1; sum += $1 }
+		END {
+			n = NR
+			mean = sum / n
+			for (i = 1; i <= n; i++)
+				ss += (v[i] - mean) ^ 2
+			median = n % 2 ? v[(n + 1) / 2] : (v[n / 2] + v[n / 2 + 1]) / 2
+			p90 = int(0.9 * n) == 0.9 * n ? v[0.9 * n] : v[int(0.9 * n) + 1]
+			stddev = n > 1 ? sqrt(ss / (n - 1)) : 0
+			printf "%s %d %.1f %d %.1f %d %.1f\n", name, n, median, p90,
+			       stddev, v[1], mean
+		}' >> "$tmp" || exit 1
+done
+
+awk 'BEGIN {
+		printf "%-10s %8s %10s %10s %10s %10s\n", "kernel", "samples",
+		       "median", "p90", "stddev", "min"
+	}
+	{ printf "%-10s %8d %10.1f %10d %10.1f %10d\n", $1, $2, $3, $4, $5, $6 }
+' "$tmp"
+
+if [ -n "$json" ]; then
+	awk -v warmup="$warmup" '
+		BEGIN { printf "{\n  \"unit\": \"us\",\n  \"warmup\": %d,\n", warmup
+			printf "  \"kernels\": [\n" }
+		NR > 1 { printf ",\n" }
+		{ printf "    { \"name\": \"%s\", \"samples\": %d, \"median\": %s, " \
+			 "\"p90\": %s, \"stddev\": %s, \"min\": %s, \"mean\": %s }",
+			 $1, $2, $3, $4, $5, $6, $7 }
+		END { printf "\n  ]\n}\n" }
+	' "$tmp" > "$json" || exit 1
+fi
+
+[ -z "$baseline" ] && exit 0
+
+echo
+echo "Compared with $baseline (threshold ${threshold}%):"
+awk -v threshold="$threshold" '
+	# baseline: one kernel per line, as written by -j
+	FNR == NR {
+		if ($0 ~ /"name":/) {
+			name = $0; sub(/.*"name": "/, "", name); sub(/".*/, "", name)
+			median = $0; sub(/.*"median": /, "", median); sub(/,.*/, "", median)
+			base[name] = median
+		}
+		next
+	}
+	{
+		if (!($1 in base) || base[$1] <= 0) {
+			printf "%-10s %10.1f %10s\n", $1, $3, "(new)"
+			next
+		}
+		delta = ($3 - base[$1]) * 100 / base[$1]
+		verdict = ""
+		if (delta > threshold) {
+			verdict = "REGRESSION"
+			regressions++
+		} else if (delta < -threshold) {
+			verdict = "improved"
+		}
+		printf "%-10s %10.1f %10.1f %+8.1f%%%s\n", $1, base[$1], $3, delta,
+		       verdict == "" ? "" : " " verdict
+	}
+	END { exit regressions > 0 }
+' "$baseline" "$tmp"
@@ -14,8 +14,8 @@
  *
  * Eigth to A64 register mapping is:
  *
- * [0..7] r0..r7 to w19..w26
- * [8..11] arg0..arg3 to w0..w3
+ * [0..7] r0..r7 to w19..w26 (or x19..x26)
+ * [8..11] arg0..arg3 to w0..w3 (or x0..x3)
  * [12] wzero (31)
  */
 static reg_t REG(reg_t x)
@@ -38,12 +38,15 @@ static reg_t REG(reg_t x)
 /*
  * \brief Pack bits ready to "or" into an opcode
  */
-static reg_t bits(reg_t val, reg_t width, reg_t shift)
+static code_t bits(code_t val, code_t width, code_t shift)
 {
-	return (((1 << width) - 1) & val) << shift;
+	return (((1u << width) - 1) & val) << shift;
 }
 
 
+#define XTMP 9
+#define XIP0 16
+#define XIP1 17
 #define XFP 29
 #define XLR 30
 #define XSP 31
@@ -55,6 +58,10 @@ static reg_t bits(reg_t val, reg_t width, reg_t shift)
 #define ASR 2
 #define ROR 3
 
+/* extend options for register offset addressing */
+#define UXTW 2
+#define UXTX 3
+
 enum condition_codes {
 	C_EQ,
 	C_NE,
@@ -79,14 +86,55 @@ enum condition_codes {
 	(0x11000000 | bits((imm12), 12, 10) | bits((Rn), 5, 5) | bits((Rt), 5, 0))
 #define OP_ADD_IMM_X(Rt, Rn, imm12) \
 	(0x91000000 | bits((imm12), 12, 10) | bits((Rn), 5, 5) | bits((Rt), 5, 0))
+#define OP_ADD_REG_W(Rd, Rn, Rm) \
+	(0x0b000000 | bits((Rm), 5, 16) | bits((Rn), 5, 5) | bits((Rd), 5, 0))
+#define OP_ADD_REG_X(Rd, Rn, Rm) \
+	(0x8b000000 | bits((Rm), 5, 16) | bits((Rn), 5, 5) | bits((Rd), 5, 0))
+#define OP_ADDV_8B(Vd, Vn) \
+	(0x0e31b800 | bits((Vn), 5, 5) | bits((Vd), 5, 0))
 #define OP_B(offset) \
 	(0x14000000 | bits((offset), 26, 0))
 #define OP_B_COND(cond, offset) \
 	(0x54000000 | bits((offset), 19, 5) | bits((cond), 4, 0))
 #define OP_BL(offset) \
 	(0x94000000 | bits((offset), 26, 0))
+#define OP_BR(Rn) \
+	(0xd61f0000 | bits((Rn), 5, 5))
+#define OP_CBNZ_W(Rt, offset) \
+	(0x35000000 | bits((offset), 19, 5) | bits((Rt), 5, 0))
+#define OP_CBNZ_X(Rt, offset) \
+	(0xb5000000 | bits((offset), 19, 5) | bits((Rt), 5, 0))
+#define OP_CLZ_W(Rd, Rn) \
+	(0x5ac01000 | bits((Rn), 5, 5) | bits((Rd), 5, 0))
+#define OP_CLZ_X(Rd, Rn) \
+	(0xdac01000 | bits((Rn), 5, 5) | bits((Rd), 5, 0))
 #define OP_CMP_REG_W(Rn, Rm) OP_SUBS_REG_W(WZR, (Rn), (Rm))
 #define OP_CMP_REG_X(Rn, Rm) OP_SUBS_REG_X(XZR, (Rn), (Rm))
+#define OP_CNT_8B(Vd, Vn) \
+	(0x0e205800 | bits((Vn), 5, 5) | bits((Vd), 5, 0))
+#define OP_DMB_ISH() 0xd5033bbf
+#define OP_FMOV_TO_S(Sd, Wn) \
+	(0x1e270000 | bits((Wn), 5, 5) | bits((Sd), 5, 0))
+#define OP_FMOV_TO_D(Dd, Xn) \
+	(0x9e670000 | bits((Xn), 5, 5) | bits((Dd), 5, 0))
+#define OP_FMOV_FROM_S(Wd, Sn) \
+	(0x1e260000 | bits((Sn), 5, 5) | bits((Wd), 5, 0))
+#define OP_FMOV_FROM_D(Xd, Dn) \
+	(0x9e660000 | bits((Dn), 5, 5) | bits((Xd), 5, 0))
+#define OP_LDAR_W(Rt, Rn) \
+	(0x88dffc00 | bits((Rn), 5, 5) | bits((Rt), 5, 0))
+#define OP_LDAR_X(Rt, Rn) \
+	(0xc8dffc00 | bits((Rn), 5, 5) | bits((Rt), 5, 0))
+#define OP_LDAXR_W(Rt, Rn) \
+	(0x885ffc00 | bits((Rn), 5, 5) | bits((Rt), 5, 0))
+#define OP_LDAXR_X(Rt, Rn) \
+	(0xc85ffc00 | bits((Rn), 5, 5) | bits((Rt), 5, 0))
+#define OP_LDRB_POST(Rt, Rn, imm9) \
+	(0x38400400 | bits((imm9), 9, 12) | bits((Rn), 5, 5) | bits((Rt), 5, 0))
+#define OP_LDRB_OFFSET(Rt, Rn, imm12) \
+	(0x39400000 | bits((imm12), 12, 10) | bits((Rn), 5, 5) | bits((Rt), 5, 0))
+#define OP_LDRB_REG(Rt, Rn, Rm, option) \
+	(0x38600800 | bits((Rm), 5, 16) | bits((option), 3, 13) | bits((Rn), 5, 5) | bits((Rt), 5, 0))
 #define OP_LDP_POST_W(Rt, Rt2, Rn, imm7) \
 	(0x28c00000 | bits((imm7), 7, 15) | bits((Rt2), 5, 10) | bits((Rn), 5, 5) | bits((Rt), 5, 0))
 #define OP_LDP_POST_X(Rt, Rt2, Rn, imm7) \
@@ -111,6 +159,10 @@ enum condition_codes {
 	(0xb9400000 | bits((imm12), 12, 10) | bits((Rn), 5, 5) | bits((Rt), 5, 0))
 #define OP_LDR_OFFSET_X(Rt, Rn, imm12) \
 	(0xf9400000 | bits((imm12), 12, 10) | bits((Rn), 5, 5) | bits((Rt), 5, 0))
+#define OP_LDR_REG_W(Rt, Rn, Rm, option, S) \
+	(0xb8600800 | bits((Rm), 5, 16) | bits((option), 3, 13) | bits((S), 1, 12) | bits((Rn), 5, 5) | bits((Rt), 5, 0))
+#define OP_LDR_REG_X(Rt, Rn, Rm, option, S) \
+	(0xf8600800 | bits((Rm), 5, 16) | bits((option), 3, 13) | bits((S), 1, 12) | bits((Rn), 5, 5) | bits((Rt), 5, 0))
 #define OP_MOV_SP(Rd, Rn) OP_ADD_IMM_X(Rd, (Rn), 0)
 #define OP_MOV_IMM_W(Rd, imm16) OP_MOVZ_W(Rd, imm16, 0)
 #define OP_MOV_IMM_X(Rd, imm16) OP_MOVZ_X(Rd, imm16, 0)
@@ -124,14 +176,42 @@ enum condition_codes {
 	(0x52800000 | bits((lsl) >> 4, 2, 21) | bits((imm16), 16, 5) | bits((Rd), 5, 0))
 #define OP_MOVZ_X(Rd, imm16, lsl) \
 	(0xd2800000 | bits((lsl) >> 4, 2, 21) | bits((imm16), 16, 5) | bits((Rd), 5, 0))
+#define OP_NEG_W(Rd, Rm) OP_SUB_REG_W(Rd, WZR, (Rm))
+#define OP_NEG_X(Rd, Rm) OP_SUB_REG_X(Rd, XZR, (Rm))
 #define OP_ORR_REG_W(Rt, Rn, Rm, shift, imm6)                \
 	(0x2a000000 | bits((shift), 2, 22) | bits((Rm), 5, 16) | \
 	 bits((imm6), 6, 10) | bits((Rn), 5, 5) | bits((Rt), 5, 0))
 #define OP_ORR_REG_X(Rt, Rn, Rm, shift, imm6)                \
 	(0xaa000000 | bits((shift), 2, 22) | bits((Rm), 5, 16) | \
 	 bits((imm6), 6, 10) | bits((Rn), 5, 5) | bits((Rt), 5, 0))
+#define OP_RBIT_W(Rd, Rn) \
+	(0x5ac00000 | bits((Rn), 5, 5) | bits((Rd), 5, 0))
+#define OP_RBIT_X(Rd, Rn) \
+	(0xdac00000 | bits((Rn), 5, 5) | bits((Rd), 5, 0))
 #define OP_RET(Rn) \
 	(0xd65f0000 | bits((Rn), 5, 5))
+#define OP_REV_W(Rd, Rn) \
+	(0x5ac00800 | bits((Rn), 5, 5) | bits((Rd), 5, 0))
+#define OP_REV_X(Rd, Rn) \
+	(0xdac00c00 | bits((Rn), 5, 5) | bits((Rd), 5, 0))
+#define OP_RORV_W(Rd, Rn, Rm) \
+	(0x1ac02c00 | bits((Rm), 5, 16) | bits((Rn), 5, 5) | bits((Rd), 5, 0))
+#define OP_RORV_X(Rd, Rn, Rm) \
+	(0x9ac02c00 | bits((Rm), 5, 16) | bits((Rn), 5, 5) | bits((Rd), 5, 0))
+#define OP_STLR_W(Rt, Rn) \
+	(0x889ffc00 | bits((Rn), 5, 5) | bits((Rt), 5, 0))
+#define OP_STLR_X(Rt, Rn) \
+	(0xc89ffc00 | bits((Rn), 5, 5) | bits((Rt), 5, 0))
+#define OP_STLXR_W(Rs, Rt, Rn) \
+	(0x8800fc00 | bits((Rs), 5, 16) | bits((Rn), 5, 5) | bits((Rt), 5, 0))
+#define OP_STLXR_X(Rs, Rt, Rn) \
+	(0xc800fc00 | bits((Rs), 5, 16) | bits((Rn), 5, 5) | bits((Rt), 5, 0))
+#define OP_STRB_POST(Rt, Rn, imm9) \
+	(0x38000400 | bits((imm9), 9, 12) | bits((Rn), 5, 5) | bits((Rt), 5, 0))
+#define OP_STRB_OFFSET(Rt, Rn, imm12) \
+	(0x39000000 | bits((imm12), 12, 10) | bits((Rn), 5, 5) | bits((Rt), 5, 0))
+#define OP_STRB_REG(Rt, Rn, Rm, option) \
+	(0x38200800 | bits((Rm), 5, 16) | bits((option), 3, 13) | bits((Rn), 5, 5) | bits((Rt), 5, 0))
 #define OP_STP_POST_W(Rt, Rt2, Rn, imm7) \
 	(0x28800000 | bits((imm7), 7, 15) | bits((Rt2), 5, 10) | bits((Rn), 5, 5) | bits((Rt), 5, 0))
 #define OP_STP_POST_X(Rt, Rt2, Rn, imm7) \
@@ -156,22 +236,94 @@ enum condition_codes {
 	(0xb9000000 | bits((imm12), 12, 10) | bits((Rn), 5, 5) | bits((Rt), 5, 0))
 #define OP_STR_OFFSET_X(Rt, Rn, imm12) \
 	(0xf9000000 | bits((imm12), 12, 10) | bits((Rn), 5, 5) | bits((Rt), 5, 0))
+#define OP_STR_REG_W(Rt, Rn, Rm, option, S) \
+	(0xb8200800 | bits((Rm), 5, 16) | bits((option), 3, 13) | bits((S), 1, 12) | bits((Rn), 5, 5) | bits((Rt), 5, 0))
+#define OP_STR_REG_X(Rt, Rn, Rm, option, S) \
+	(0xf8200800 | bits((Rm), 5, 16) | bits((option), 3, 13) | bits((S), 1, 12) | bits((Rn), 5, 5) | bits((Rt), 5, 0))
+#define OP_SUB_REG_W(Rd, Rn, Rm) \
+	(0x4b000000 | bits((Rm), 5, 16) | bits((Rn), 5, 5) | bits((Rd), 5, 0))
+#define OP_SUB_REG_X(Rd, Rn, Rm) \
+	(0xcb000000 | bits((Rm), 5, 16) | bits((Rn), 5, 5) | bits((Rd), 5, 0))
 #define OP_SUBS_REG_W(Rd, Rn, Rm) \
 	(0x6b000000 | bits((Rm), 5, 16) | bits((Rn), 5, 5) | bits((Rd), 5, 0))
 #define OP_SUBS_REG_X(Rd, Rn, Rm) \
 	(0xeb000000 | bits((Rm), 5, 16) | bits((Rn), 5, 5) | bits((Rd), 5, 0))
+
+/* Register width variants of the opcodes used to operate on eigth registers */
+#ifdef CONFIG_REG64
+#define OP_ADD_IMM OP_ADD_IMM_X
+#define OP_ADD_REG OP_ADD_REG_X
+#define OP_CLZ OP_CLZ_X
+#define OP_CMP_REG OP_CMP_REG_X
+#define OP_FMOV_TO OP_FMOV_TO_D
+#define OP_LDAR OP_LDAR_X
+#define OP_LDAXR OP_LDAXR_X
+#define OP_LDR_OFFSET OP_LDR_OFFSET_X
+#define OP_LDR_POST OP_LDR_POST_X
+#define OP_LDR_REG OP_LDR_REG_X
+#define OP_MOV_IMM OP_MOV_IMM_X
+#define OP_MOV_REG OP_MOV_REG_X
+#define OP_MOVK OP_MOVK_X
+#define OP_NEG OP_NEG_X
+#define OP_RBIT OP_RBIT_X
+#define OP_REV OP_REV_X
+#define OP_RORV OP_RORV_X
+#define OP_STLR OP_STLR_X
+#define OP_STLXR OP_STLXR_X
+#define OP_STR_OFFSET OP_STR_OFFSET_X
+#define OP_STR_POST OP_STR_POST_X
+#define OP_STR_REG OP_STR_REG_X
+#define OP_SUB_REG OP_SUB_REG_X
+#define RZR XZR
+#define UXTR UXTX
+#else
+#define OP_ADD_IMM OP_ADD_IMM_W
+#define OP_ADD_REG OP_ADD_REG_W
+#define OP_CLZ OP_CLZ_W
+#define OP_CMP_REG OP_CMP_REG_W
+#define OP_FMOV_TO OP_FMOV_TO_S
+#define OP_LDAR OP_LDAR_W
+#define OP_LDAXR OP_LDAXR_W
+#define OP_LDR_OFFSET OP_LDR_OFFSET_W
+#define OP_LDR_POST OP_LDR_POST_W
+#define OP_LDR_REG OP_LDR_REG_W
+#define OP_MOV_IMM OP_MOV_IMM_W
+#define OP_MOV_REG OP_MOV_REG_W
+#define OP_MOVK OP_MOVK_W
+#define OP_NEG OP_NEG_W
+#define OP_RBIT OP_RBIT_W
+#define OP_REV OP_REV_W
+#define OP_RORV OP_RORV_W
+#define OP_STLR OP_STLR_W
+#define OP_STLXR OP_STLXR_W
+#define OP_STR_OFFSET OP_STR_OFFSET_W
+#define OP_STR_POST OP_STR_POST_W
+#define OP_STR_REG OP_STR_REG_W
+#define OP_SUB_REG OP_SUB_REG_W
+#define RZR WZR
+#define UXTR UXTW
+#endif
+
 // TODO: OP_SUBS_SHIFTREG and _SXREG (don't want complexity of sign extending in all uses of maths ops)
 
-static reg_t *assemble_prologue(reg_t *ip, int narg, struct operand *op)
+static code_t *assemble_mov_imm(code_t *ip, reg_t reg, reg_t value)
+{
+	*ip++ = OP_MOV_IMM(reg, value & 0xffff);
+	for (int lsl = 16; lsl < REG_BITS; lsl += 16)
+		if ((value >> lsl) & 0xffff)
+			*ip++ = OP_MOVK(reg, (value >> lsl) & 0xffff, lsl);
+
+	return ip;
+}
+
+static code_t *assemble_prologue(code_t *ip, int narg, struct operand *op)
 {
 	switch (op->type) {
 	case REGISTER:
-		*ip++ = OP_MOV_REG_W(ARG(narg), REG(op->value));
+		*ip++ = OP_MOV_REG(ARG(narg), REG(op->value));
 		break;
 	case IMMEDIATE:
-		*ip++ = OP_MOV_IMM_W(ARG(narg), op->value & 0xffff);
-		if (op->value >> 16)
-			*ip++ = OP_MOVK_W(ARG(narg), op->value >> 16, 16);
+		ip = assemble_mov_imm(ip, ARG(narg), op->value);
 		break;
 	case ARGUMENT:
 	case INVALID:
@@ -182,32 +334,228 @@ static reg_t *assemble_prologue(reg_t *ip, int narg, struct operand *op)
 	return ip;
 }
 
-static reg_t *assemble_epilogue(reg_t *ip, struct operand *op)
+static code_t *assemble_epilogue(code_t *ip, struct operand *op)
+{
+	if (op->type == REGISTER)
+		*ip++ = OP_MOV_REG(REG(op->value), ARG(0));
+
+	return ip;
+}
+
+/*
+ * Get the A64 register holding an operand, loading immediates into the
+ * argument register for that operand if needed.
+ */
+static reg_t assemble_operand(code_t **ip, int narg, struct operand *op)
 {
 	if (op->type == REGISTER)
-		*ip++ = OP_MOV_REG_W(REG(op->value), ARG(0));
+		return REG(op->value);
+
+	*ip = assemble_prologue(*ip, narg, op);
+	return ARG(narg);
+}
+
+static int count_operands(struct command *word)
+{
+	int narg;
+
+	for (narg = 0; narg < 4; narg++)
+		if (word->operand[narg].type == INVALID)
+			break;
+
+	return narg;
+}
+
+/*
+ * Expand intrinsics inline. Unlike calls these operate directly on the
+ * registers named in the operands. Returns NULL if word cannot be
+ * expanded (in which case it must be called instead).
+ */
+static code_t *assemble_intrinsic(code_t *ip, struct command *word)
+{
+	struct operand *op = word->operand;
+	int narg = count_operands(word);
+	reg_t dst, a, b, c;
+
+	switch (word->sym->intrinsic) {
+	case I_BSWAP:
+	case I_CLZ:
+	case I_CTZ:
+	case I_LDW_ACQ:
+	case I_POPCNT:
+	case I_STW_REL:
+		if (narg != 2)
+			return NULL;
+		break;
+	case I_FENCE:
+		*ip++ = OP_DMB_ISH();
+		return ip;
+	case I_CAS:
+		if (narg != 4)
+			return NULL;
+		break;
+	case I_LDB_POST:
+	case I_LDW_POST:
+	case I_STB_POST:
+	case I_STW_POST:
+		// we can only write back a pointer held in a register
+		if (narg != 2 || op[1].type != REGISTER)
+			return NULL;
+		break;
+	case I_LDB:
+	case I_LDW:
+	case I_ROL:
+	case I_ROR:
+	case I_STB:
+	case I_STW:
+	case I_XADD:
+	case I_XCHG:
+		if (narg != 3)
+			return NULL;
+		break;
+	default:
+		return NULL;
+	}
+
+	// an immediate destination discards the result
+	dst = op[0].type == REGISTER ? REG(op[0].value) : ARG(0);
+	a = assemble_operand(&ip, 1, &op[1]);
+
+	switch (word->sym->intrinsic) {
+	case I_BSWAP:
+		*ip++ = OP_REV(dst, a);
+		break;
+	case I_CAS:
+		// retry: ldaxr ip0, [a]; cmp ip0, b; b.ne done;
+		//        stlxr tmp, c, [a]; cbnz tmp, retry; done: mov dst, ip0
+		b = assemble_operand(&ip, 2, &op[2]);
+		c = assemble_operand(&ip, 3, &op[3]);
+		*ip++ = OP_LDAXR(XIP0, a);
+		*ip++ = OP_CMP_REG(XIP0, b);
+		*ip++ = OP_B_COND(C_NE, 3);
+		*ip++ = OP_STLXR(XTMP, c, a);
+		*ip++ = OP_CBNZ_W(XTMP, -4);
+		*ip++ = OP_MOV_REG(dst, XIP0);
+		break;
+	case I_CLZ:
+		*ip++ = OP_CLZ(dst, a);
+		break;
+	case I_CTZ:
+		*ip++ = OP_RBIT(dst, a);
+		*ip++ = OP_CLZ(dst, dst);
+		break;
+	case I_LDB:
+		b = assemble_operand(&ip, 2, &op[2]);
+		*ip++ = OP_LDRB_REG(dst, a, b, UXTR);
+		break;
+	case I_LDB_POST:
+		// writeback is unpredictable if Rt == Rn (the load wins)
+		if (dst == a)
+			*ip++ = OP_LDRB_OFFSET(dst, a, 0);
+		else
+			*ip++ = OP_LDRB_POST(dst, a, 1);
+		break;
+	case I_LDW:
+		b = assemble_operand(&ip, 2, &op[2]);
+		*ip++ = OP_LDR_REG(dst, a, b, UXTR, 1);
+		break;
+	case I_LDW_ACQ:
+		*ip++ = OP_LDAR(dst, a);
+		break;
+	case I_LDW_POST:
+		if (dst == a)
+			*ip++ = OP_LDR_OFFSET(dst, a, 0);
+		else
+			*ip++ = OP_LDR_POST(dst, a, sizeof(reg_t));
+		break;
+	case I_POPCNT:
+		// there is no scalar popcount so borrow v0 for CNT
+		*ip++ = OP_FMOV_TO(0, a);
+		*ip++ = OP_CNT_8B(0, 0);
+		*ip++ = OP_ADDV_8B(0, 0);
+		*ip++ = OP_FMOV_FROM_S(dst, 0);
+		break;
+	case I_ROL:
+		b = assemble_operand(&ip, 2, &op[2]);
+		*ip++ = OP_NEG(XIP0, b);
+		*ip++ = OP_RORV(dst, a, XIP0);
+		break;
+	case I_ROR:
+		b = assemble_operand(&ip, 2, &op[2]);
+		*ip++ = OP_RORV(dst, a, b);
+		break;
+	case I_STB:
+		dst = assemble_operand(&ip, 0, &op[0]);
+		b = assemble_operand(&ip, 2, &op[2]);
+		*ip++ = OP_STRB_REG(dst, a, b, UXTR);
+		break;
+	case I_STB_POST:
+		dst = assemble_operand(&ip, 0, &op[0]);
+		if (dst == a) {
+			*ip++ = OP_STRB_OFFSET(dst, a, 0);
+			*ip++ = OP_ADD_IMM(a, a, 1);
+		} else {
+			*ip++ = OP_STRB_POST(dst, a, 1);
+		}
+		break;
+	case I_STW:
+		dst = assemble_operand(&ip, 0, &op[0]);
+		b = assemble_operand(&ip, 2, &op[2]);
+		*ip++ = OP_STR_REG(dst, a, b, UXTR, 1);
+		break;
+	case I_STW_POST:
+		dst = assemble_operand(&ip, 0, &op[0]);
+		if (dst == a) {
+			*ip++ = OP_STR_OFFSET(dst, a, 0);
+			*ip++ = OP_ADD_IMM(a, a, sizeof(reg_t));
+		} else {
+			*ip++ = OP_STR_POST(dst, a, sizeof(reg_t));
+		}
+		break;
+	case I_STW_REL:
+		dst = assemble_operand(&ip, 0, &op[0]);
+		*ip++ = OP_STLR(dst, a);
+		break;
+	case I_XADD:
+		b = assemble_operand(&ip, 2, &op[2]);
+		*ip++ = OP_LDAXR(XIP0, a);
+		*ip++ = OP_ADD_REG(XIP1, XIP0, b);
+		*ip++ = OP_STLXR(XTMP, XIP1, a);
+		*ip++ = OP_CBNZ_W(XTMP, -3);
+		*ip++ = OP_MOV_REG(dst, XIP0);
+		break;
+	case I_XCHG:
+		b = assemble_operand(&ip, 2, &op[2]);
+		*ip++ = OP_LDAXR(XIP0, a);
+		*ip++ = OP_STLXR(XTMP, b, a);
+		*ip++ = OP_CBNZ_W(XTMP, -2);
+		*ip++ = OP_MOV_REG(dst, XIP0);
+		break;
+	default:
+		assert(false);
+	}
 
 	return ip;
 }
 
-reg_t *assemble_word(reg_t *ip, struct command *word)
+static code_t *a64_assemble_word(code_t *ip, struct command *word)
 {
 	int narg;
+	code_t *p;
 
 	if (word->sym->type == CONSTANT) {
 		reg_t reg = REG(word->operand[0].value);
 		reg_t value = word->sym->val;
 
-		*ip++ = OP_MOV_IMM_W(reg, value & 0xffff);
-		if (value >> 16)
-			*ip++ = OP_MOVK_W(reg, value >> 16, 16);
-
-		return ip;
+		return assemble_mov_imm(ip, reg, value);
 	}
 
 	assert(word->sym->type == FUNCPTR || word->sym->type == WORDPTR ||
 	       word->sym->type == EXECPTR);
 
+	if (word->sym->intrinsic && (p = assemble_intrinsic(ip, word)))
+		return p;
+
 	for (narg = 0; narg < 4; narg++) {
 		if (word->operand[narg].type == INVALID)
 			break;
@@ -215,10 +563,10 @@ reg_t *assemble_word(reg_t *ip, struct command *word)
 		ip = assemble_prologue(ip, narg, &word->operand[narg]);
 	}
 
-	reg_t absolute = word->sym->type == EXECPTR ?
-				 word->sym->val :
-				 (reg_t)(uintptr_t)word->sym->sym;
-	reg_t offset = (absolute - (reg_t) (uintptr_t) ip) / 4;
+	uintptr_t absolute = word->sym->type == EXECPTR ?
+				     (uintptr_t)word->sym->val :
+				     (uintptr_t)word->sym->sym;
+	intptr_t offset = ((intptr_t) absolute - (intptr_t) ip) / 4;
 	*ip++ = OP_BL(offset);
 
 	ip = assemble_epilogue(ip, &word->operand[0]);
@@ -226,7 +574,7 @@ reg_t *assemble_word(reg_t *ip, struct command *word)
 	return ip;
 }
 
-reg_t *assemble_ret(reg_t *ip)
+static code_t *a64_assemble_ret(code_t *ip)
 {
 	*ip++ = OP_RET(XLR);
 	return ip;
@@ -240,14 +588,35 @@ static reg_t get_frame_size(struct command *cmd, uint8_t *clobbers)
 	     i++)
 		*clobbers |= 1 << cmd->operand[i].value;
 
-	reg_t frame_size = 16 + 4 * __builtin_popcount(*clobbers);
+	reg_t frame_size = 16 + sizeof(reg_t) * __builtin_popcount(*clobbers);
 	// align up to a 16-byte boundary
 	frame_size = ((frame_size - 1) | 15) + 1;
 
 	return frame_size;
 }
 
-reg_t *assemble_preamble(reg_t *ip, struct command *cmd, uint8_t clobbers)
+/*
+ * Call a profiler hook. The argument registers are preserved because they
+ * hold our arguments on entry and the return value on exit.
+ */
+static code_t *assemble_profile_hook(code_t *ip, struct profile *prof,
+				     void (*hook)(struct profile *))
+{
+	intptr_t offset;
+
+	*ip++ = OP_STP_PRE_X(ARG(0), ARG(1), XSP, -2);
+	*ip++ = OP_STP_PRE_X(ARG(2), ARG(3), XSP, -2);
+	ip = assemble_mov_imm(ip, ARG(0), (reg_t) (uintptr_t) prof);
+	offset = ((intptr_t) hook - (intptr_t) ip) / 4;
+	*ip++ = OP_BL(offset);
+	*ip++ = OP_LDP_POST_X(ARG(2), ARG(3), XSP, 2);
+	*ip++ = OP_LDP_POST_X(ARG(0), ARG(1), XSP, 2);
+
+	return ip;
+}
+
+static code_t *a64_assemble_preamble(code_t *ip, struct command *cmd,
+				     uint8_t clobbers, struct profile *prof)
 {
 	reg_t frame_size = get_frame_size(cmd, &clobbers);
 
@@ -258,41 +627,51 @@ reg_t *assemble_preamble(reg_t *ip, struct command *cmd, uint8_t clobbers)
 	int j = 0;
 	for (int i = 0; i < 8; i++)
 		if (clobbers & (1 << i))
-			*ip++ = OP_STR_OFFSET_W(REG(i), XSP, 4 + j++);
+			*ip++ = OP_STR_OFFSET(REG(i), XSP,
+					      16 / sizeof(reg_t) + j++);
 
 	*ip++ = OP_MOV_SP(XFP, XSP);
 
+	// the link register is already saved so we are free to call the hook
+	if (prof)
+		ip = assemble_profile_hook(ip, prof, profile_enter);
+
 	// move the arguments into the right registers
 	for (int i = 0; cmd && i < lengthof(cmd->operand) &&
 			cmd->operand[i].type == REGISTER;
 	     i++)
-		*ip++ = OP_MOV_REG_W(REG(cmd->operand[i].value), ARG(i));
+		*ip++ = OP_MOV_REG(REG(cmd->operand[i].value), ARG(i));
 
 	return ip;
 }
 
-reg_t *assemble_postamble(reg_t *ip, struct command *cmd, uint8_t clobbers)
+static code_t *a64_assemble_postamble(code_t *ip, struct command *cmd,
+				      uint8_t clobbers, struct profile *prof)
 {
 	reg_t frame_size = get_frame_size(cmd, &clobbers);
 
 	// set the return value
 	if (cmd && cmd->operand[0].type == REGISTER)
-		*ip++ = OP_MOV_REG_W(ARG(0), REG(cmd->operand[0].value));
+		*ip++ = OP_MOV_REG(ARG(0), REG(cmd->operand[0].value));
+
+	if (prof)
+		ip = assemble_profile_hook(ip, prof, profile_exit);
 
 	// restore the saved registers
 	int j = 0;
 	for (int i = 0; i < 8; i++)
 		if (clobbers & (1 << i))
-			*ip++ = OP_LDR_OFFSET_W(REG(i), XSP, 4 + j++);
+			*ip++ = OP_LDR_OFFSET(REG(i), XSP,
+					      16 / sizeof(reg_t) + j++);
 
 	// pop the frame record
 	*ip++ = OP_LDP_POST_X(XFP, XLR, XSP, (frame_size / 8));
 
 
-	return assemble_ret(ip);
+	return a64_assemble_ret(ip);
 }
 
-reg_t translate_condition_code(reg_t code)
+static reg_t translate_condition_code(reg_t code)
 {
 	switch (code) {
 	case EQ:
@@ -320,14 +699,14 @@ reg_t translate_condition_code(reg_t code)
 	return C_AL;
 }
 
-reg_t *assemble_if(reg_t *ip, struct compare *cmp, reg_t **fixup)
+static code_t *a64_assemble_if(code_t *ip, struct compare *cmp, code_t **fixup)
 {
 	if (cmp->rel == CMPNZ) {
-		*ip++ = OP_CMP_REG_W(REG(cmp->op1.value), WZR);
+		*ip++ = OP_CMP_REG(REG(cmp->op1.value), RZR);
 		*fixup = ip;
 		*ip++ = OP_B_COND(C_EQ, 0);
 	} else {
-		*ip++ = OP_CMP_REG_W(REG(cmp->op1.value), REG(cmp->op2.value));
+		*ip++ = OP_CMP_REG(REG(cmp->op1.value), REG(cmp->op2.value));
 		*fixup = ip;
 		*ip++ = OP_B_COND(translate_condition_code(cmp->rel)^1, 0);
 	}
@@ -335,61 +714,126 @@ reg_t *assemble_if(reg_t *ip, struct compare *cmp, reg_t **fixup)
 	return ip;
 }
 
-reg_t *assemble_else(reg_t *ip, reg_t **fixup)
+static void a64_fixup_if(code_t *ip, code_t *fixup)
+{
+	int offset = ip - fixup;
+	*fixup |= bits(offset, 19, 5);
+}
+
+static code_t *a64_assemble_else(code_t *ip, code_t **fixup)
 {
-	reg_t *oldip = ip;
+	code_t *oldip = ip;
 	*ip++ = OP_B_COND(C_AL, 0);
-	fixup_if(ip, *fixup);
+	a64_fixup_if(ip, *fixup);
 	*fixup = oldip;
 
 	return ip;
 
 }
 
-void fixup_if(reg_t *ip, reg_t *fixup)
+static code_t *a64_assemble_while(code_t *ip, struct compare *cmp,
+				  code_t **fixup)
 {
-	int offset = ip - fixup;
-	*fixup |= bits(offset, 19, 5);
+	return a64_assemble_if(ip, cmp, fixup);
 }
 
-reg_t *assemble_while(reg_t *ip, struct compare *cmp, reg_t **fixup)
+static code_t *a64_assemble_endwhile(code_t *ip, code_t *fixup)
 {
-	return assemble_if(ip, cmp, fixup);
+	*ip = OP_B(fixup - ip - 1);
+	a64_fixup_if(++ip, fixup);
+	return ip;
 }
 
-reg_t *assemble_endwhile(reg_t *ip, reg_t *fixup)
+static code_t *a64_assemble_jump(code_t *ip, code_t **fixup)
 {
-	*ip = OP_B(fixup - ip - 1);
-	fixup_if(++ip, fixup);
+	*fixup = ip;
+	*ip++ = OP_B_COND(C_AL, 0);
 	return ip;
 }
 
-void disassemble(FILE *f, reg_t *ip)
+static code_t *a64_assemble_branch_imm(code_t *ip, int reg, enum relop rel,
+				       reg_t value, code_t **fixup)
 {
-	fprintf(stderr, "TODO: Cannot disassemble yet\n");
+	ip = assemble_mov_imm(ip, XIP0, value);
+	*ip++ = OP_CMP_REG(REG(reg), rel == CMPNZ ? RZR : XIP0);
+	*fixup = ip;
+	*ip++ = OP_B_COND(rel == CMPNZ ? C_NE : translate_condition_code(rel),
+			  0);
+
+	return ip;
+}
+
+static code_t *a64_assemble_jump_table(code_t *ip, int reg,
+				       struct jump_table *t)
+{
+	int offset;
+
+	// the subtraction wraps values below lo so one unsigned compare
+	// catches both ends of the range
+	ip = assemble_mov_imm(ip, XIP0, t->lo);
+	*ip++ = OP_SUB_REG(XIP0, REG(reg), XIP0);
+	ip = assemble_mov_imm(ip, XIP1, t->n);
+	*ip++ = OP_CMP_REG(XIP0, XIP1);
+	offset = (code_t *) (uintptr_t) t->deflt - ip;
+	*ip++ = OP_B_COND(C_HS, offset);
+
+	ip = assemble_mov_imm(ip, XIP1, (uintptr_t) t->target);
+	*ip++ = OP_LDR_REG_W(XIP1, XIP1, XIP0, UXTR, 1);
+	*ip++ = OP_BR(XIP1);
+
+	return ip;
 }
 
-static struct regset regs;
+static void a64_disassemble(FILE *f, code_t *ip)
+{
+	fprintf(stderr, "TODO: Cannot disassemble yet\n");
+}
 
-void exec(reg_t *ip)
+static __thread struct regset regs;
+
+#ifdef CONFIG_REG64
+#define LOAD_REGS                                \
+	"ldp	x19, x20, [x27, 0]\n\t"          \
+	"ldp	x21, x22, [x27, 16]\n\t"         \
+	"ldp	x23, x24, [x27, 32]\n\t"         \
+	"ldp	x25, x26, [x27, 48]\n\t"         \
+	"ldp	x0, x1, [x27, 64]\n\t"           \
+	"ldp	x2, x3, [x27, 80]\n\t"
+#define STORE_REGS                               \
+	"stp	x19, x20, [x27, 0]\n\t"          \
+	"stp	x21, x22, [x27, 16]\n\t"         \
+	"stp	x23, x24, [x27, 32]\n\t"         \
+	"stp	x25, x26, [x27, 48]\n\t"         \
+	"str	x0, [x27, 64]\n\t"
+#else
+#define LOAD_REGS                                \
+	"ldp	w19, w20, [x27, 0]\n\t"          \
+	"ldp	w21, w22, [x27, 8]\n\t"          \
+	"ldp	w23, w24, [x27, 16]\n\t"         \
+	"ldp	w25, w26, [x27, 24]\n\t"         \
+	"ldp	w0, w1, [x27, 32]\n\t"           \
+	"ldp	w2, w3, [x27, 40]\n\t"
+#define STORE_REGS                               \
+	"stp	w19, w20, [x27, 0]\n\t"          \
+	"stp	w21, w22, [x27, 8]\n\t"          \
+	"stp	w23, w24, [x27, 16]\n\t"         \
+	"stp	w25, w26, [x27, 24]\n\t"         \
+	"str	w0, [x27, 32]\n\t"
+#endif
+
+static void a64_exec(code_t *ip)
 {
 	__asm__ __volatile__("mov	x27, %0\n\t"
-			     "ldp	w19, w20, [x27, 0]\n\t"
-			     "ldp	w21, w22, [x27, 8]\n\t"
-			     "ldp	w23, w24, [x27, 16]\n\t"
-			     "ldp	w25, w26, [x27, 24]\n\t"
+			     LOAD_REGS
 			     "blr	%1\n\t"
-			     "stp	w19, w20, [x27, 0]\n\t"
-			     "stp	w21, w22, [x27, 8]\n\t"
-			     "stp	w23, w24, [x27, 16]\n\t"
-			     "stp	w25, w26, [x27, 24]\n\t"
+			     STORE_REGS
 			     :
 			     : "r"(&regs), "r"(ip)
 			     : "r0", "r1", "r2", "r3", "r4", "r5", "r6", "r7",
 			       "r8", "r9", "r10", "r11", "r12", "r13", "r14",
 			       "r15", "r16", "r17", "r19", "r20", "r21",
 			       "r22", "r23", "r24", "r25", "r26", "r27", "r30",
-			       "cc", "memory");
+			       "v0", "cc", "memory");
 }
 
 
@@ -402,12 +846,31 @@ void exec(reg_t *ip)
  *       made when we called exec(). In practice this means we can only use
  *       the `dump` opcode from the top level (it won't work inside function)
  */
-struct regset get_regs()
+static struct regset a64_get_regs()
 {
 	assert(regs.zero == 0);
 	return regs;
 }
 
+/*!
+ * \brief Set an argument register ready for the next exec()
+ */
+static void a64_set_arg(int n, reg_t val)
+{
+	regs.arg[n] = val;
+}
+
+/*!
+ * \brief Replace the saved registers
+ *
+ * Like get_regs() this only affects the copy made by exec(). The live
+ * registers are saved and restored by whoever is switching context.
+ */
+static void a64_set_regs(const struct regset *r)
+{
+	regs = *r;
+}
+
 /*!
  * \brief Allow the caller to overrider the default stack pointer
  *
@@ -415,6 +878,29 @@ struct regset get_regs()
  *       a pointer to stack allocated data (since stack is above 32-bit
  *       boundary). Happily at present this isn't supported...
  */
-void set_sp(reg_t sp)
+static void a64_set_sp(reg_t sp)
 {
 }
+
+const struct backend a64_backend = {
+	.name = "native",
+	.assemble_word = a64_assemble_word,
+	.assemble_ret = a64_assemble_ret,
+	.assemble_preamble = a64_assemble_preamble,
+	.assemble_postamble = a64_assemble_postamble,
+	.assemble_if = a64_assemble_if,
+	.assemble_else = a64_assemble_else,
+	.assemble_while = a64_assemble_while,
+	.assemble_endwhile = a64_assemble_endwhile,
+	.assemble_tier = NULL, // native code is already the top tier
+	.assemble_jump = a64_assemble_jump,
+	.assemble_branch_imm = a64_assemble_branch_imm,
+	.assemble_jump_table = a64_assemble_jump_table,
+	.fixup_if = a64_fixup_if,
+	.disassemble = a64_disassemble,
+	.exec = a64_exec,
+	.get_regs = a64_get_regs,
+	.set_arg = a64_set_arg,
+	.set_regs = a64_set_regs,
+	.set_sp = a64_set_sp,
+};
@@ -0,0 +1,192 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+/*!
+ * \file case.c
+ * \brief Code generation for case statements
+ *
+ *     case r1
+ *     of 1
+ *         ...
+ *     of 2, 3
+ *         ...
+ *     default
+ *         ...
+ *     end
+ *
+ * The values are not all known until the whole statement has been parsed
+ * so the bodies are emitted first, each ending with a branch to the end
+ * of the statement, and the dispatch code is emitted after them:
+ *
+ *         b       dispatch
+ *     1:  ...
+ *         b       end
+ *     2:  ...
+ *         b       end
+ *     d:  ...                 (empty when there is no default)
+ *         b       end
+ *     dispatch:
+ *         ...
+ *     end:
+ *
+ * Dense values dispatch through a bounds-checked jump table. Sparse values
+ * are found with a binary search that ends in a short chain of compares.
+ */
+
+#include "eigth.h"
+
+/* use a table for at least this many values filling at least half of it */
+#define MIN_TABLE 4
+/* compare values one by one once the search is down to this many */
+#define MAX_COMPARES 3
+
+static void *grow(void *p, size_t *max, size_t sz)
+{
+	*max = *max ? 2 * *max : 16;
+	p = realloc(p, *max * sz);
+	if (!p)
+		die("Cannot allocate case statement");
+
+	return p;
+}
+
+static int by_value(const void *a, const void *b)
+{
+	const struct case_label *p = a, *q = b;
+
+	return (sreg_t) p->value < (sreg_t) q->value ? -1 :
+	       (sreg_t) p->value > (sreg_t) q->value ? 1 : 0;
+}
+
+code_t *case_begin(const struct backend *b, code_t *ip, struct case_block *c,
+		   int reg)
+{
+	memset(c, 0, sizeof(*c));
+	c->reg = reg;
+
+	return b->assemble_jump(ip, &c->dispatch);
+}
+
+static code_t *assemble_end_of_body(const struct backend *b, code_t *ip,
+				    struct case_block *c)
+{
+	if (c->nends == c->maxends)
+		c->ends = grow(c->ends, &c->maxends, sizeof(*c->ends));
+
+	return b->assemble_jump(ip, &c->ends[c->nends++]);
+}
+
+/*!
+ * \brief Start the body of an `of` or `default`
+ *
+ * The previous body (if there is one) branches to the end of the statement
+ * rather than falling through.
+ */
+code_t *case_section(const struct backend *b, code_t *ip,
+		     struct case_block *c)
+{
+	if (c->nlabels || c->deflt)
+		ip = assemble_end_of_body(b, ip, c);
+
+	return ip;
+}
+
+void case_of(struct case_block *c, reg_t value, code_t *ip)
+{
+	if (c->nlabels == c->maxlabels)
+		c->labels = grow(c->labels, &c->maxlabels, sizeof(*c->labels));
+
+	c->labels[c->nlabels].value = value;
+	c->labels[c->nlabels].target = ip;
+	c->nlabels++;
+}
+
+void case_default(struct case_block *c, code_t *ip)
+{
+	if (c->deflt)
+		die("case: more than one default");
+	c->deflt = ip;
+}
+
+static code_t *assemble_table(const struct backend *b, code_t *ip,
+			      struct case_block *c, reg_t span)
+{
+	struct jump_table *t = alloc(sizeof(*t) + span * sizeof(*t->target));
+
+	t->lo = c->labels[0].value;
+	t->n = span;
+	t->deflt = (uintptr_t) c->deflt;
+	for (reg_t i = 0; i < span; i++)
+		t->target[i] = t->deflt;
+	for (size_t i = 0; i < c->nlabels; i++)
+		t->target[c->labels[i].value - t->lo] =
+			(uintptr_t) c->labels[i].target;
+
+	return b->assemble_jump_table(ip, c->reg, t);
+}
+
+static code_t *assemble_tree(const struct backend *b, code_t *ip,
+			     struct case_block *c, size_t lo, size_t hi)
+{
+	code_t *fixup;
+	size_t mid;
+
+	if (hi - lo <= MAX_COMPARES) {
+		for (size_t i = lo; i < hi; i++) {
+			ip = b->assemble_branch_imm(ip, c->reg, EQ,
+						    c->labels[i].value,
+						    &fixup);
+			b->fixup_if(c->labels[i].target, fixup);
+		}
+		ip = b->assemble_jump(ip, &fixup);
+		b->fixup_if(c->deflt, fixup);
+		return ip;
+	}
+
+	mid = lo + (hi - lo) / 2;
+	ip = b->assemble_branch_imm(ip, c->reg, LT, c->labels[mid].value,
+				    &fixup);
+	ip = assemble_tree(b, ip, c, mid, hi);
+	b->fixup_if(ip, fixup);
+
+	return assemble_tree(b, ip, c, lo, mid);
+}
+
+code_t *case_end(const struct backend *b, code_t *ip, struct case_block *c)
+{
+	reg_t span = 0;
+
+	// without a default the branch at the end of the last body doubles
+	// as the target for values that do not match
+	if (!c->deflt)
+		c->deflt = ip;
+	ip = assemble_end_of_body(b, ip, c);
+	b->fixup_if(ip, c->dispatch);
+
+	qsort(c->labels, c->nlabels, sizeof(*c->labels), by_value);
+	for (size_t i = 1; i < c->nlabels; i++)
+		if (c->labels[i].value == c->labels[i - 1].value)
+			die("case: duplicate value %" PRIdREG,
+			    c->labels[i].value);
+
+	if (c->nlabels)
+		span = c->labels[c->nlabels - 1].value - c->labels[0].value + 1;
+	if (c->nlabels >= MIN_TABLE && span && span <= 2 * c->nlabels)
+		ip = assemble_table(b, ip, c, span);
+	else
+		ip = assemble_tree(b, ip, c, 0, c->nlabels);
+
+	for (size_t i = 0; i < c->nends; i++)
+		b->fixup_if(ip, c->ends[i]);
+	case_discard(c);
+
+	return ip;
+}
+
+/*!
+ * \brief Release a case statement (case_end() does this itself)
+ */
+void case_discard(struct case_block *c)
+{
+	free(c->ends);
+	free(c->labels);
+}
@@ -0,0 +1,111 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+/*!
+ * \file coro.c
+ * \brief Coroutines
+ *
+ * A coroutine runs a word on its own stack. `resume` switches into the
+ * coroutine and `yield` switches back out again, each passing a value to
+ * the other side.
+ *
+ * The switch itself is handled by swapcontext(), which saves the native
+ * registers (and therefore the A64 registers holding r0..r7). The VM keeps
+ * its registers in memory so these are swapped explicitly. Each coroutine
+ * has both a native stack and a VM stack carved from core memory.
+ */
+
+/* the ucontext functions are not part of C99 */
+#define _DEFAULT_SOURCE
+
+#include "eigth.h"
+#include <ucontext.h>
+
+#define CORO_MIN_STACKSZ (16 * 1024)
+
+struct coro {
+	ucontext_t ctx;
+	ucontext_t caller;
+	struct coro *prev;
+	struct regset regs;
+	reg_t word;
+	reg_t transfer;
+	bool running;
+	bool done;
+};
+
+static __thread struct coro *current;
+
+static void coro_main(void)
+{
+	struct coro *co = current;
+
+	set_arg(0, co->transfer);
+	exec((code_t *) (uintptr_t) co->word);
+	co->transfer = get_regs().arg[0];
+	co->done = true;
+
+	current = co->prev;
+	setcontext(&co->caller);
+}
+
+struct coro *coro_new(reg_t word, reg_t stacksz)
+{
+	struct coro *co = alloc_aligned(sizeof(*co), CACHELINE);
+	size_t native = stacksz < CORO_MIN_STACKSZ ? CORO_MIN_STACKSZ : stacksz;
+
+	memset(co, 0, sizeof(*co));
+	co->word = word;
+	co->regs.sp = (reg_t) (uintptr_t) alloc_aligned(stacksz, 16) + stacksz;
+
+	if (getcontext(&co->ctx))
+		die("Cannot create coroutine");
+	co->ctx.uc_stack.ss_sp = alloc_aligned(native, 16);
+	co->ctx.uc_stack.ss_size = native;
+	co->ctx.uc_link = NULL;
+	makecontext(&co->ctx, coro_main, 0);
+
+	return co;
+}
+
+reg_t op_done(reg_t _, reg_t c)
+{
+	return ((struct coro *) (uintptr_t) c)->done;
+}
+
+reg_t op_resume(reg_t _, reg_t c, reg_t v)
+{
+	struct coro *co = (struct coro *) (uintptr_t) c;
+	struct regset saved = get_regs();
+
+	if (co->done)
+		die("resume: coroutine has finished");
+	if (co->running)
+		die("resume: coroutine is already running");
+
+	co->transfer = v;
+	co->prev = current;
+	co->running = true;
+	current = co;
+
+	set_regs(&co->regs);
+	swapcontext(&co->caller, &co->ctx);
+	co->regs = get_regs();
+	set_regs(&saved);
+
+	co->running = false;
+	return co->transfer;
+}
+
+reg_t op_yield(reg_t _, reg_t v)
+{
+	struct coro *co = current;
+
+	if (!co)
+		die("yield: not in a coroutine");
+
+	co->transfer = v;
+	current = co->prev;
+	swapcontext(&co->ctx, &co->caller);
+
+	return co->transfer;
+}
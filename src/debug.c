@@ -58,7 +58,7 @@ static void dbgi_operand(FILE *f, struct operand *op)
 {
 	fprintf(f, "{ ");
 	dbgi_optype(f, op->type);
-	fprintf(f, ", %u }", op->value);
+	fprintf(f, ", %" PRIuREG " }", op->value);
 }
 
 void dbg_operand(FILE *f, struct operand *op)
@@ -101,7 +101,7 @@ static void dbgi_symbol(FILE *f, struct symbol *s)
 	}
 	fprintf(f, "{ \"%s\", ", s->name);
 	dbgi_symtype(f, s->type);
-	fprintf(f, ", 0x%x, %p }", s->val, s->next);
+	fprintf(f, ", 0x%" PRIxREG ", %p }", s->val, s->next);
 
 }
 
@@ -127,7 +127,7 @@ void dbg_command(FILE *f, struct command *c)
 
 static void dbgi_reg(FILE *f, reg_t reg)
 {
-	fprintf(f, "%u", reg);
+	fprintf(f, "%" PRIuREG, reg);
 }
 
 void dbg_reg(FILE *f, reg_t reg)
@@ -5,6 +5,7 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <inttypes.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -15,8 +16,38 @@
 
 #define lengthof(x) ((sizeof(x) / sizeof(*(x))))
 
+#define CACHELINE 64
+
+/*
+ * Registers are 32-bit unless we are built with CONFIG_REG64. Either way
+ * the core memory, and all the code pointers, sit below the 4GB boundary.
+ */
+#ifdef CONFIG_REG64
+typedef uint64_t reg_t;
+typedef int64_t sreg_t;
+#define PRIdREG PRId64
+#define PRIuREG PRIu64
+#define PRIxREG PRIx64
+#else
 typedef uint32_t reg_t;
 typedef int32_t sreg_t;
+#define PRIdREG PRId32
+#define PRIuREG PRIu32
+#define PRIxREG PRIx32
+#endif
+
+#define REG_BITS (8 * sizeof(reg_t))
+
+/* A single instruction (or literal) within generated code */
+typedef uint32_t code_t;
+
+/*
+ * Most code (in code_t) that a single command, a piece of control flow or
+ * the preamble or postamble of a word assembles to. The dispatch code of
+ * a case statement can take up to CASE_SLACK more for each value.
+ */
+#define CODE_SLACK 256
+#define CASE_SLACK 16
 
 struct regset {
 	reg_t r[8];
@@ -71,6 +102,34 @@ struct compare {
 	struct operand op2;
 };
 
+/*
+ * Builtins that the code generators know how to expand inline (rather
+ * than calling the C implementation).
+ */
+enum intrinsic {
+	NOT_INTRINSIC,
+	I_BSWAP,
+	I_CAS,
+	I_CLZ,
+	I_CTZ,
+	I_FENCE,
+	I_LDB,
+	I_LDB_POST,
+	I_LDW,
+	I_LDW_ACQ,
+	I_LDW_POST,
+	I_POPCNT,
+	I_ROL,
+	I_ROR,
+	I_STB,
+	I_STB_POST,
+	I_STW,
+	I_STW_POST,
+	I_STW_REL,
+	I_XADD,
+	I_XCHG,
+};
+
 struct symbol {
 	const char *name;
 	enum symtype type;
@@ -78,9 +137,108 @@ struct symbol {
 		reg_t (*sym)();
 		reg_t val;
 	};
+	enum intrinsic intrinsic;
+	bool rewinds; // running it rewinds the core (markers)
 	struct symbol *next;
 };
 
+/*
+ * A slab of fixed-size objects. Free objects are kept on an intrusive
+ * singly linked list (the first word of each free object points to the
+ * next one).
+ */
+struct pool {
+	reg_t free;
+	reg_t objsize;
+	reg_t base;
+	reg_t limit;
+};
+
+#define POOL_POISON_BYTE 0x6b
+
+/*
+ * Hardware performance counters that pstart/pstop/pread work with.
+ */
+enum perf_counter {
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_BRANCH_MISSES,
+	PERF_L1D_MISSES,
+	PERF_LLC_MISSES,
+	NR_PERF_COUNTERS
+};
+
+/*
+ * A bounded ring buffer queue. The producer and consumer indices live on
+ * separate cache lines. Single producer queues also keep a (possibly
+ * stale) copy of the other side's index so that they only need to touch
+ * the other cache line when the queue looks full (or empty).
+ *
+ * Multi-producer/multi-consumer queues use a sequence number in each
+ * slot and every slot is padded to a cache line. Single producer queues
+ * use a plain array of registers.
+ */
+struct queue {
+	reg_t tail __attribute__((aligned(CACHELINE)));
+	reg_t head_cache;
+	reg_t head __attribute__((aligned(CACHELINE)));
+	reg_t tail_cache;
+	reg_t mask __attribute__((aligned(CACHELINE)));
+	reg_t mpmc;
+	reg_t slots;
+};
+
+struct queue_slot {
+	reg_t seq;
+	reg_t val;
+} __attribute__((aligned(CACHELINE)));
+
+struct profile;
+struct tier;
+
+/* commands retained for tiered execution (see tier.c) */
+enum ir_kind {
+	IR_WORD,
+	IR_RECURSE,
+	IR_IF,
+	IR_ELSE,
+	IR_ENDIF,
+	IR_WHILE,
+	IR_ENDWHILE,
+	IR_CASE,
+	IR_OF,
+	IR_DEFAULT,
+	IR_ENDCASE,
+};
+
+/*
+ * Dispatch table for a dense case statement (see case.c). Code sits below
+ * 4GB so the targets are stored as 32-bit addresses.
+ */
+struct jump_table {
+	reg_t lo;
+	reg_t n;
+	uint32_t deflt;
+	uint32_t target[];
+};
+
+struct case_label {
+	reg_t value;
+	code_t *target;
+};
+
+struct case_block {
+	int reg;
+	code_t *dispatch; // branch to the dispatch code (after the bodies)
+	code_t *deflt;
+	code_t **ends; // branches from the end of each body
+	size_t nends;
+	size_t maxends;
+	struct case_label *labels;
+	size_t nlabels;
+	size_t maxlabels;
+};
+
 struct command {
 	char opcode[32];
 	struct symbol *sym;
@@ -92,32 +250,218 @@ static inline void clear_cache(reg_t begin, reg_t end) {
 				(char *)(uintptr_t)end);
 }
 
-reg_t *assemble_word(reg_t *ip, struct command *cmd);
-reg_t *assemble_ret(reg_t *ip);
-reg_t *assemble_preamble(reg_t *ip, struct command *cmd, uint8_t clobbers);
-reg_t *assemble_postamble(reg_t *ip, struct command *cmd, uint8_t clobbers);
-reg_t *assemble_if(reg_t *ip, struct compare *cmp, reg_t **fixup);
-reg_t *assemble_else(reg_t *ip, reg_t **fixup);
-reg_t *assemble_while(reg_t *ip, struct compare *cmp, reg_t **fixup);
-reg_t *assemble_endwhile(reg_t *ip, reg_t *fixup);
-void fixup_if(reg_t *ip, reg_t *fixup);
-void disassemble(FILE *f, reg_t *ip);
-void exec(reg_t *ip);
-struct regset get_regs(void);
-void set_sp(reg_t sp);
+#ifdef CONFIG_REG64
+static inline reg_t reg_bswap(reg_t x)
+{
+	return __builtin_bswap64(x);
+}
+
+static inline reg_t reg_clz(reg_t x)
+{
+	return x ? __builtin_clzll(x) : REG_BITS;
+}
+
+static inline reg_t reg_ctz(reg_t x)
+{
+	return x ? __builtin_ctzll(x) : REG_BITS;
+}
+
+static inline reg_t reg_popcnt(reg_t x)
+{
+	return __builtin_popcountll(x);
+}
+#else
+static inline reg_t reg_bswap(reg_t x)
+{
+	return __builtin_bswap32(x);
+}
+
+static inline reg_t reg_clz(reg_t x)
+{
+	return x ? __builtin_clz(x) : REG_BITS;
+}
+
+static inline reg_t reg_ctz(reg_t x)
+{
+	return x ? __builtin_ctz(x) : REG_BITS;
+}
+
+static inline reg_t reg_popcnt(reg_t x)
+{
+	return __builtin_popcount(x);
+}
+#endif
+
+static inline reg_t reg_rol(reg_t x, reg_t n)
+{
+	const reg_t mask = REG_BITS - 1;
+
+	return (x << (n & mask)) | (x >> (-n & mask));
+}
+
+static inline reg_t reg_ror(reg_t x, reg_t n)
+{
+	const reg_t mask = REG_BITS - 1;
+
+	return (x >> (n & mask)) | (x << (-n & mask));
+}
+
+/*
+ * Code generator and execution engine. The portable VM is always linked
+ * in, together with the native code generator on hosts that have one, and
+ * the backend is chosen at startup (see --backend).
+ */
+struct backend {
+	const char *name;
+	code_t *(*assemble_word)(code_t *ip, struct command *cmd);
+	code_t *(*assemble_ret)(code_t *ip);
+	code_t *(*assemble_preamble)(code_t *ip, struct command *cmd,
+				     uint8_t clobbers, struct profile *prof);
+	code_t *(*assemble_postamble)(code_t *ip, struct command *cmd,
+				      uint8_t clobbers, struct profile *prof);
+	code_t *(*assemble_if)(code_t *ip, struct compare *cmp,
+			       code_t **fixup);
+	code_t *(*assemble_else)(code_t *ip, code_t **fixup);
+	code_t *(*assemble_while)(code_t *ip, struct compare *cmp,
+				  code_t **fixup);
+	code_t *(*assemble_endwhile)(code_t *ip, code_t *fixup);
+	code_t *(*assemble_tier)(code_t *ip, struct tier *t);
+	code_t *(*assemble_jump)(code_t *ip, code_t **fixup);
+	code_t *(*assemble_branch_imm)(code_t *ip, int reg, enum relop rel,
+				       reg_t value, code_t **fixup);
+	code_t *(*assemble_jump_table)(code_t *ip, int reg,
+				       struct jump_table *t);
+	void (*fixup_if)(code_t *ip, code_t *fixup);
+	void (*disassemble)(FILE *f, code_t *ip);
+	void (*exec)(code_t *ip);
+	struct regset (*get_regs)(void);
+	void (*set_arg)(int n, reg_t val);
+	void (*set_regs)(const struct regset *r);
+	void (*set_sp)(reg_t sp);
+};
+
+extern const struct backend *backend;
+extern const struct backend *tier_backend;
+extern const struct backend vm_backend;
+#ifdef CONFIG_A64
+extern const struct backend a64_backend;
+#endif
+
+static inline code_t *assemble_word(code_t *ip, struct command *cmd)
+{
+	return backend->assemble_word(ip, cmd);
+}
+
+static inline code_t *assemble_ret(code_t *ip)
+{
+	return backend->assemble_ret(ip);
+}
+
+static inline code_t *assemble_preamble(code_t *ip, struct command *cmd,
+					uint8_t clobbers, struct profile *prof)
+{
+	return backend->assemble_preamble(ip, cmd, clobbers, prof);
+}
+
+static inline code_t *assemble_postamble(code_t *ip, struct command *cmd,
+					 uint8_t clobbers, struct profile *prof)
+{
+	return backend->assemble_postamble(ip, cmd, clobbers, prof);
+}
+
+static inline code_t *assemble_if(code_t *ip, struct compare *cmp,
+				  code_t **fixup)
+{
+	return backend->assemble_if(ip, cmp, fixup);
+}
+
+static inline code_t *assemble_else(code_t *ip, code_t **fixup)
+{
+	return backend->assemble_else(ip, fixup);
+}
+
+static inline code_t *assemble_while(code_t *ip, struct compare *cmp,
+				     code_t **fixup)
+{
+	return backend->assemble_while(ip, cmp, fixup);
+}
+
+static inline code_t *assemble_endwhile(code_t *ip, code_t *fixup)
+{
+	return backend->assemble_endwhile(ip, fixup);
+}
+
+static inline void fixup_if(code_t *ip, code_t *fixup)
+{
+	backend->fixup_if(ip, fixup);
+}
+
+static inline void disassemble(FILE *f, code_t *ip)
+{
+	backend->disassemble(f, ip);
+}
+
+static inline void exec(code_t *ip)
+{
+	backend->exec(ip);
+}
+
+static inline struct regset get_regs(void)
+{
+	return backend->get_regs();
+}
+
+static inline void set_arg(int n, reg_t val)
+{
+	backend->set_arg(n, val);
+}
+
+static inline void set_regs(const struct regset *r)
+{
+	backend->set_regs(r);
+}
+
+static inline void set_sp(reg_t sp)
+{
+	backend->set_sp(sp);
+}
 
 void register_ops(void);
 
 void *alloc(size_t sz);
+void *alloc_aligned(size_t sz, size_t align);
+code_t *code_begin(void);
+void code_end(code_t *begin, code_t *end);
+bool code_room(code_t *ip, size_t words);
 void die(const char *fmt, ...);
+bool in_code(uintptr_t p);
+void *map_low(size_t sz, int prot, int fd);
+void io_flush(void);
 void parse_array(void);
 void parse_bytes(void);
+void parse_case(void);
 void parse_const(void);
 void parse_define(void);
+void parse_forget(void);
 void parse_if(void);
+void parse_marker(void);
+void parse_coro(void);
+void parse_pool(void);
+void parse_profile(void);
+void parse_queue(bool mpmc);
+void parse_recurse(void);
 void parse_string(void);
 void parse_var(void);
 void parse_while(void);
+void profile_enable(bool on);
+void profile_enter(struct profile *p);
+void profile_exit(struct profile *p);
+void profile_forget(code_t *code, char *mem);
+struct profile *profile_new(code_t *word);
+void profile_report(FILE *f);
+void profile_reset(void);
+void *scratch_alloc(size_t sz);
+void scratch_reset(void);
 void symtab_add(struct symbol *s);
 void symtab_define(void);
 void symtab_disassemble(void);
@@ -126,7 +470,65 @@ void symtab_list(FILE *f);
 struct symbol *symtab_lookup(const char *name);
 const char *symtab_name(reg_t addr);
 struct symbol *symtab_new(const char *name, enum symtype type, reg_t val);
+code_t *case_begin(const struct backend *b, code_t *ip, struct case_block *c,
+		   int reg);
+void case_default(struct case_block *c, code_t *ip);
+void case_discard(struct case_block *c);
+code_t *case_end(const struct backend *b, code_t *ip, struct case_block *c);
+void case_of(struct case_block *c, reg_t value, code_t *ip);
+code_t *case_section(const struct backend *b, code_t *ip,
+		     struct case_block *c);
+struct coro *coro_new(reg_t word, reg_t stacksz);
+code_t *tier_count(struct tier *t);
+void tier_enable(reg_t after);
+void tier_forget(code_t *code);
+size_t tier_mark(struct tier *t);
+struct tier *tier_new(code_t *entry, struct command *cmd, uint8_t clobbers);
+void tier_record(struct tier *t, enum ir_kind kind, struct command *cmd,
+		 struct compare *cmp);
+void tier_rewind(struct tier *t, size_t mark);
+reg_t op_close(reg_t _, reg_t fd);
+reg_t op_done(reg_t _, reg_t c);
+reg_t op_getb(reg_t _, reg_t fd);
+reg_t op_join(reg_t _, reg_t handle);
+reg_t op_mapfile(reg_t _, reg_t path, reg_t writable);
+reg_t op_maplen(reg_t _, reg_t base);
+reg_t op_mkstemp(reg_t _, reg_t path);
+reg_t op_open(reg_t _, reg_t path, reg_t flags);
+reg_t op_pfor(reg_t word, reg_t start, reg_t end, reg_t grain);
+reg_t op_pread(reg_t _, reg_t n);
+reg_t op_pstart(reg_t _);
+reg_t op_pstop(reg_t _);
+reg_t op_putb(reg_t c, reg_t fd);
+reg_t op_qpop(reg_t _, reg_t q, reg_t out);
+reg_t op_qpopn(reg_t _, reg_t q, reg_t p, reg_t n);
+reg_t op_qpush(reg_t _, reg_t q, reg_t v);
+reg_t op_qpushn(reg_t _, reg_t q, reg_t p, reg_t n);
+reg_t op_read(reg_t _, reg_t fd, reg_t p, reg_t n);
+reg_t op_resume(reg_t _, reg_t c, reg_t v);
+reg_t op_spawn(reg_t _, reg_t word, reg_t arg);
+reg_t op_unlink(reg_t _, reg_t path);
+reg_t op_unmap(reg_t _, reg_t base);
 reg_t op_us(reg_t _);
+reg_t op_write(reg_t _, reg_t fd, reg_t p, reg_t n);
+reg_t op_yield(reg_t _, reg_t v);
+
+reg_t op_vadd(reg_t d, reg_t a, reg_t b, reg_t n);
+reg_t op_vadds(reg_t d, reg_t a, reg_t s, reg_t n);
+reg_t op_vand(reg_t d, reg_t a, reg_t b, reg_t n);
+reg_t op_vands(reg_t d, reg_t a, reg_t s, reg_t n);
+reg_t op_vmax(reg_t _, reg_t a, reg_t n);
+reg_t op_vmin(reg_t _, reg_t a, reg_t n);
+reg_t op_vmul(reg_t d, reg_t a, reg_t b, reg_t n);
+reg_t op_vmuls(reg_t d, reg_t a, reg_t s, reg_t n);
+reg_t op_vor(reg_t d, reg_t a, reg_t b, reg_t n);
+reg_t op_vors(reg_t d, reg_t a, reg_t s, reg_t n);
+reg_t op_vscan(reg_t d, reg_t a, reg_t n);
+reg_t op_vsub(reg_t d, reg_t a, reg_t b, reg_t n);
+reg_t op_vsubs(reg_t d, reg_t a, reg_t s, reg_t n);
+reg_t op_vsum(reg_t _, reg_t a, reg_t n);
+reg_t op_vxor(reg_t d, reg_t a, reg_t b, reg_t n);
+reg_t op_vxors(reg_t d, reg_t a, reg_t s, reg_t n);
 
 void dbg_optype(FILE *f, enum optype t);
 void dbg_operand(FILE *f, struct operand *op);
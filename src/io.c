@@ -0,0 +1,339 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+/*!
+ * \file io.c
+ * \brief File descriptor I/O
+ *
+ * `read` and `write` move data directly between a file descriptor and
+ * core memory. `getb` and `putb` work a byte at a time but go via large
+ * per-descriptor buffers so that they do not make a system call for every
+ * byte. Buffered input is drained by `read` and buffered output is
+ * flushed before `write`, `close` and at exit, so the two styles can be
+ * mixed on the same descriptor. Byte output to stdout goes via stdio
+ * instead so that it stays in order with `print` and friends, and so that
+ * it can be used from several threads. The buffers of other descriptors
+ * are not locked so each of them must only be used by one thread at a
+ * time.
+ *
+ * `mkstemp` creates and opens a new file, replacing the trailing XXXXXX of
+ * the path (which must be a string in core memory) with a unique name,
+ * and `unlink` removes a file.
+ *
+ * All the words return -1 on error (except getb, which returns -1 at end
+ * of file too).
+ *
+ * `mapfile` maps a whole file into the window between the core memory and
+ * the 4GB boundary so that it can be scanned in place with ldb/ldw. It
+ * returns the address of the mapping (or zero on error) and `maplen`
+ * reports its length.
+ */
+
+/* open() and friends are POSIX rather than C99 */
+#define _DEFAULT_SOURCE
+
+#include "eigth.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define IOBUFSZ (64 * 1024)
+#define MAX_FDS 64
+
+/* the core memory sits at 64MB so leave it plenty of room */
+#define MAP_BASE 0x08000000
+#define MAP_LIMIT 0xf0000000
+
+struct iobuf {
+	char *in;
+	size_t inpos;
+	size_t inlen;
+	char *out;
+	size_t outlen;
+};
+
+static struct iobuf iobufs[MAX_FDS];
+
+struct mapping {
+	reg_t base;
+	reg_t len;
+	struct mapping *next;
+};
+
+static struct mapping *mappings;
+static uintptr_t mapp = MAP_BASE;
+
+static struct iobuf *iobuf(reg_t fd)
+{
+	if (fd >= MAX_FDS)
+		die("Bad file descriptor: %" PRIdREG, fd);
+
+	return &iobufs[fd];
+}
+
+static ssize_t write_all(int fd, const char *p, size_t n)
+{
+	size_t done = 0;
+
+	while (done < n) {
+		ssize_t res = write(fd, p + done, n - done);
+		if (res < 0)
+			return res;
+		done += res;
+	}
+
+	return done;
+}
+
+static reg_t flush_out(reg_t fd)
+{
+	struct iobuf *b = iobuf(fd);
+	ssize_t res = 0;
+
+	if (b->outlen)
+		res = write_all(fd, b->out, b->outlen);
+	b->outlen = 0;
+
+	return res < 0 ? -1 : 0;
+}
+
+/*!
+ * \brief Flush stdout and any buffered putb output
+ */
+void io_flush(void)
+{
+	fflush(stdout);
+	for (int fd = 0; fd < MAX_FDS; fd++)
+		(void) flush_out(fd);
+}
+
+static char *alloc_buf(void)
+{
+	char *p = malloc(IOBUFSZ);
+
+	if (!p)
+		die("Cannot allocate I/O buffer");
+
+	return p;
+}
+
+reg_t op_close(reg_t _, reg_t fd)
+{
+	struct iobuf *b = iobuf(fd);
+	reg_t res = flush_out(fd);
+
+	b->inpos = b->inlen = 0;
+	if (close(fd) < 0)
+		res = -1;
+
+	return res;
+}
+
+reg_t op_getb(reg_t _, reg_t fd)
+{
+	struct iobuf *b = iobuf(fd);
+
+	if (b->inpos == b->inlen) {
+		ssize_t res;
+
+		if (!b->in)
+			b->in = alloc_buf();
+		res = read(fd, b->in, IOBUFSZ);
+		if (res <= 0)
+			return -1;
+		b->inpos = 0;
+		b->inlen = res;
+	}
+
+	return (uint8_t) b->in[b->inpos++];
+}
+
+static struct mapping *find_mapping(reg_t base)
+{
+	for (struct mapping *m = mappings; m; m = m->next)
+		if (m->base == base)
+			return m;
+
+	return NULL;
+}
+
+/*!
+ * \brief Map sz bytes of fd (or of anonymous memory if fd is -1) below 4GB
+ *
+ * This is also used for runtime memory that must be addressable from
+ * the registers but must outlive a marker (such as thread stacks), which
+ * therefore cannot come from the core memory. sz must be a multiple of
+ * the page size.
+ */
+void *map_low(size_t sz, int prot, int fd)
+{
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	int flags = MAP_PRIVATE | MAP_FIXED_NOREPLACE |
+		    (fd < 0 ? MAP_ANONYMOUS : 0);
+	uintptr_t a;
+
+	pthread_mutex_lock(&lock);
+	a = mapp;
+
+	// search upwards from the last mapping, wrapping around once
+	for (uintptr_t tried = 0; tried < MAP_LIMIT - MAP_BASE; tried += sz) {
+		if (a + sz > MAP_LIMIT)
+			a = MAP_BASE;
+
+		void *p = mmap((void *) a, sz, prot, flags, fd, 0);
+		if (p == (void *) a) {
+			mapp = a + sz;
+			pthread_mutex_unlock(&lock);
+			return p;
+		}
+		if (p != MAP_FAILED)
+			munmap(p, sz);
+
+		a += sz;
+	}
+	pthread_mutex_unlock(&lock);
+
+	return NULL;
+}
+
+reg_t op_mapfile(reg_t _, reg_t path, reg_t writable)
+{
+	int fd = open((char *) (uintptr_t) path, O_RDONLY);
+	int prot = PROT_READ | (writable ? PROT_WRITE : 0);
+	long pagesz = sysconf(_SC_PAGESIZE);
+	struct mapping *m;
+	struct stat st;
+	void *p = NULL;
+
+	if (fd < 0)
+		return 0;
+	if (!fstat(fd, &st) && st.st_size > 0 &&
+	    st.st_size < MAP_LIMIT - MAP_BASE)
+		p = map_low((st.st_size + pagesz - 1) & ~(pagesz - 1), prot,
+			    fd);
+	close(fd);
+	if (!p)
+		return 0;
+
+	// not from alloc() since a marker must not be able to free it
+	m = malloc(sizeof(*m));
+	if (!m)
+		die("Cannot allocate mapping");
+	m->base = (reg_t) (uintptr_t) p;
+	m->len = st.st_size;
+	m->next = mappings;
+	mappings = m;
+
+	return m->base;
+}
+
+reg_t op_maplen(reg_t _, reg_t base)
+{
+	struct mapping *m = find_mapping(base);
+
+	return m ? m->len : 0;
+}
+
+/* descriptors beyond MAX_FDS have no buffers so they cannot be used */
+static reg_t new_fd(int fd)
+{
+	if (fd >= MAX_FDS) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+reg_t op_open(reg_t _, reg_t path, reg_t flags)
+{
+	return new_fd(open((char *) (uintptr_t) path, flags, 0666));
+}
+
+reg_t op_mkstemp(reg_t _, reg_t path)
+{
+	return new_fd(mkstemp((char *) (uintptr_t) path));
+}
+
+reg_t op_putb(reg_t c, reg_t fd)
+{
+	struct iobuf *b = iobuf(fd);
+
+	// share the stdio buffer so output stays in order with print, etc
+	// (and with other threads, since stdio locks the stream)
+	if (fd == STDOUT_FILENO)
+		return putc(c, stdout) == EOF ? (reg_t) -1 : c;
+
+	if (!b->out) {
+		static bool registered;
+
+		if (!registered)
+			registered = !atexit(io_flush);
+		b->out = alloc_buf();
+	}
+	if (b->outlen == IOBUFSZ && flush_out(fd))
+		return -1;
+	b->out[b->outlen++] = c;
+
+	return c;
+}
+
+reg_t op_unlink(reg_t _, reg_t path)
+{
+	return unlink((char *) (uintptr_t) path) ? (reg_t) -1 : 0;
+}
+
+reg_t op_unmap(reg_t _, reg_t base)
+{
+	struct mapping **pm = &mappings;
+	long pagesz = sysconf(_SC_PAGESIZE);
+
+	for (; *pm; pm = &(*pm)->next) {
+		struct mapping *m = *pm;
+
+		if (m->base != base)
+			continue;
+
+		munmap((void *) (uintptr_t) m->base,
+		       (m->len + pagesz - 1) & ~(pagesz - 1));
+		*pm = m->next;
+		free(m);
+		return 0;
+	}
+
+	return -1;
+}
+
+reg_t op_read(reg_t _, reg_t fd, reg_t p, reg_t n)
+{
+	struct iobuf *b = iobuf(fd);
+	char *dst = (char *) (uintptr_t) p;
+	size_t buffered = b->inlen - b->inpos;
+	ssize_t res;
+
+	// hand over anything getb has already buffered
+	if (buffered) {
+		if (buffered > n)
+			buffered = n;
+		memcpy(dst, b->in + b->inpos, buffered);
+		b->inpos += buffered;
+		return buffered;
+	}
+
+	res = read(fd, dst, n);
+	return res < 0 ? (reg_t) -1 : (reg_t) res;
+}
+
+reg_t op_write(reg_t _, reg_t fd, reg_t p, reg_t n)
+{
+	ssize_t res;
+
+	if (flush_out(fd))
+		return -1;
+	if (fd == STDOUT_FILENO)
+		fflush(stdout);
+
+	res = write_all(fd, (char *) (uintptr_t) p, n);
+	return res < 0 ? (reg_t) -1 : (reg_t) res;
+}
@@ -1,6 +1,40 @@
 /* SPDX-License-Identifier: GPL-3.0-or-later */
 
 #include "eigth.h"
+#include <fcntl.h>
+
+/*
+ * Format numbers right-aligned into the end of a buffer (returning a
+ * pointer to the first character) rather than going through printf().
+ */
+#define FMTBUF (REG_BITS / 3 + 3)
+
+static char *format_dec(char *end, reg_t a)
+{
+	reg_t u = (sreg_t) a < 0 ? -a : a;
+	char *p = end;
+
+	do {
+		*--p = '0' + u % 10;
+		u /= 10;
+	} while (u);
+	if ((sreg_t) a < 0)
+		*--p = '-';
+
+	return p;
+}
+
+static char *format_hex(char *end, reg_t a)
+{
+	char *p = end;
+
+	do {
+		*--p = "0123456789abcdef"[a & 15];
+		a >>= 4;
+	} while (a);
+
+	return p;
+}
 
 static reg_t op_add(reg_t _, reg_t a, reg_t b)
 {
@@ -20,7 +54,7 @@ static reg_t op_and(reg_t _, reg_t a, reg_t b)
 static reg_t op_assert(reg_t a, reg_t b)
 {
 	if (a != b)
-		die("Assertion failed: 0x%x != 0x%x", a, b);
+		die("Assertion failed: 0x%" PRIxREG " != 0x%" PRIxREG, a, b);
 
 	return a;
 }
@@ -31,18 +65,74 @@ static reg_t op_array(void)
 	return 0;
 }
 
+static reg_t op_bswap(reg_t _, reg_t a)
+{
+	return reg_bswap(a);
+}
+
 static reg_t op_bytes(void)
 {
 	parse_bytes();
 	return 0;
 }
 
+static reg_t op_case(void)
+{
+	parse_case();
+	return 0;
+}
+
+/*
+ * Atomic operations are sequentially consistent unless their name says
+ * otherwise. The read-modify-write operations return the old value.
+ */
+static reg_t op_cas(reg_t _, reg_t p, reg_t expected, reg_t desired)
+{
+	(void) __atomic_compare_exchange_n((reg_t *) (uintptr_t) p, &expected,
+					   desired, false, __ATOMIC_SEQ_CST,
+					   __ATOMIC_SEQ_CST);
+	return expected;
+}
+
+static reg_t op_clz(reg_t _, reg_t a)
+{
+	return reg_clz(a);
+}
+
+/*
+ * The bulk memory operations lean on libc, which selects vectorized
+ * implementations suitable for the host CPU when the program is loaded.
+ */
+static reg_t op_compare(reg_t _, reg_t a, reg_t b, reg_t n)
+{
+	int res = memcmp((void *) (uintptr_t) a, (void *) (uintptr_t) b, n);
+
+	return res < 0 ? -1 : res > 0;
+}
+
 static reg_t op_const(void)
 {
 	parse_const();
 	return 0;
 }
 
+static reg_t op_copy(reg_t dst, reg_t src, reg_t n)
+{
+	memmove((void *) (uintptr_t) dst, (void *) (uintptr_t) src, n);
+	return dst;
+}
+
+static reg_t op_coro(void)
+{
+	parse_coro();
+	return 0;
+}
+
+static reg_t op_ctz(reg_t _, reg_t a)
+{
+	return reg_ctz(a);
+}
+
 static reg_t op_define(void)
 {
 	parse_define();
@@ -71,9 +161,42 @@ static reg_t op_exit(reg_t a)
 	exit(a);
 }
 
+static reg_t op_fence(void)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return 0;
+}
+
+static reg_t op_fill(reg_t dst, reg_t val, reg_t n)
+{
+	memset((void *) (uintptr_t) dst, val, n);
+	return dst;
+}
+
+static reg_t op_find(reg_t _, reg_t p, reg_t c, reg_t n)
+{
+	return (reg_t) (uintptr_t) memchr((void *) (uintptr_t) p, c, n);
+}
+
+static reg_t op_flush(void)
+{
+	io_flush();
+	return 0;
+}
+
+static reg_t op_forget(void)
+{
+	parse_forget();
+	return 0;
+}
+
 static reg_t op_hex(reg_t a)
 {
-	printf("%x\n", a);
+	char buf[FMTBUF];
+	char *p = format_hex(buf + sizeof(buf) - 1, a);
+
+	buf[sizeof(buf) - 1] = '\n';
+	fwrite(p, 1, buf + sizeof(buf) - p, stdout);
 
 	return a;
 }
@@ -89,11 +212,37 @@ static reg_t op_ldb(reg_t _, reg_t p, reg_t off)
 	return ((uint8_t *) (uintptr_t) p)[off];
 }
 
+/*
+ * The post-increment forms can only advance the pointer when they are
+ * expanded inline. If they are called (because the pointer is not held in a
+ * register) then they behave like a plain load or store.
+ */
+static reg_t op_ldb_post(reg_t _, reg_t p)
+{
+	return *(uint8_t *) (uintptr_t) p;
+}
+
 static reg_t op_ldw(reg_t _, reg_t p, reg_t off)
 {
 	return ((reg_t *) (uintptr_t) p)[off];
 }
 
+static reg_t op_ldw_acq(reg_t _, reg_t p)
+{
+	return __atomic_load_n((reg_t *) (uintptr_t) p, __ATOMIC_ACQUIRE);
+}
+
+static reg_t op_ldw_post(reg_t _, reg_t p)
+{
+	return *(reg_t *) (uintptr_t) p;
+}
+
+static reg_t op_marker(void)
+{
+	parse_marker();
+	return 0;
+}
+
 static reg_t op_mov(reg_t _, reg_t a)
 {
 	return a;
@@ -109,9 +258,63 @@ static reg_t op_or(reg_t _, reg_t a, reg_t b)
 	return a | b;
 }
 
+static reg_t op_pget(reg_t _, reg_t p)
+{
+	struct pool *pool = (struct pool *) (uintptr_t) p;
+	reg_t obj = pool->free;
+
+	if (!obj)
+		return 0;
+
+	reg_t *link = (reg_t *) (uintptr_t) obj;
+	pool->free = *link;
+
+#ifdef POOL_POISON
+	uint8_t *q = (uint8_t *) (link + 1);
+	for (reg_t i = sizeof(reg_t); i < pool->objsize; i++)
+		if (*q++ != POOL_POISON_BYTE)
+			die("pget: 0x%" PRIxREG " modified after pput",
+				    obj);
+#endif
+
+	return obj;
+}
+
+static reg_t op_pool(void)
+{
+	parse_pool();
+	return 0;
+}
+
+static reg_t op_pput(reg_t obj, reg_t p)
+{
+	struct pool *pool = (struct pool *) (uintptr_t) p;
+
+	if (obj < pool->base || obj >= pool->limit ||
+	    (obj - pool->base) % pool->objsize)
+		die("pput: 0x%" PRIxREG " does not belong to pool", obj);
+
+#ifdef POOL_POISON
+	memset((char *) (uintptr_t) obj, POOL_POISON_BYTE, pool->objsize);
+#endif
+	*(reg_t *) (uintptr_t) obj = pool->free;
+	pool->free = obj;
+
+	return obj;
+}
+
+static reg_t op_popcnt(reg_t _, reg_t a)
+{
+	return reg_popcnt(a);
+}
+
 static reg_t op_print(reg_t a)
 {
-	printf("%d\n", a);
+	char buf[FMTBUF];
+	char *p = format_dec(buf + sizeof(buf) - 1, a);
+
+	buf[sizeof(buf) - 1] = '\n';
+	fwrite(p, 1, buf + sizeof(buf) - p, stdout);
 
 	return a;
 }
@@ -125,11 +328,50 @@ static reg_t op_putc(reg_t a)
 
 static reg_t op_puts(reg_t a)
 {
-	printf("%s", (char *) (uintptr_t) a);
+	fputs((char *) (uintptr_t) a, stdout);
 
 	return a;
 }
 
+static reg_t op_recurse(void)
+{
+	parse_recurse();
+	return 0;
+}
+
+static reg_t op_rol(reg_t _, reg_t a, reg_t b)
+{
+	return reg_rol(a, b);
+}
+
+static reg_t op_ror(reg_t _, reg_t a, reg_t b)
+{
+	return reg_ror(a, b);
+}
+
+static reg_t op_profile(void)
+{
+	parse_profile();
+	return 0;
+}
+
+static reg_t op_queue(void)
+{
+	parse_queue(true);
+	return 0;
+}
+
+static reg_t op_scratch(reg_t _, reg_t sz)
+{
+	return (reg_t) (uintptr_t) scratch_alloc(sz);
+}
+
+static reg_t op_scratch_reset(void)
+{
+	scratch_reset();
+	return 0;
+}
+
 static reg_t op_shl(reg_t _, reg_t a, reg_t b)
 {
 	return a << b;
@@ -137,19 +379,27 @@ static reg_t op_shl(reg_t _, reg_t a, reg_t b)
 
 static reg_t op_shr(reg_t _, reg_t a, reg_t b)
 {
-	reg_t sb = (a >> 31) & 1;
-	reg_t partial = (~(1u << 31) & a) >> b;
+	const reg_t top = REG_BITS - 1;
+	reg_t sb = (a >> top) & 1;
+	reg_t partial = (~((reg_t) 1 << top) & a) >> b;
 
 
-	return partial | (sb << (31 - b));
+	return partial | (sb << (top - b));
 }
 
 static reg_t op_shra(reg_t _, reg_t a, reg_t b)
 {
-	reg_t sb = ((a >> 31) & 1) * -1u;
-	reg_t partial = (~(1u << 31) & a) >> b;
+	const reg_t top = REG_BITS - 1;
+	reg_t sb = ((a >> top) & 1) * (reg_t) -1;
+	reg_t partial = (~((reg_t) 1 << top) & a) >> b;
 
-	return partial | (sb << (31 - b));
+	return partial | (sb << (top - b));
+}
+
+static reg_t op_spsc(void)
+{
+	parse_queue(false);
+	return 0;
 }
 
 static reg_t op_stb(reg_t a, reg_t p, reg_t off)
@@ -158,6 +408,12 @@ static reg_t op_stb(reg_t a, reg_t p, reg_t off)
 	return a;
 }
 
+static reg_t op_stb_post(reg_t a, reg_t p)
+{
+	*(uint8_t *) (uintptr_t) p = a;
+	return a;
+}
+
 static reg_t op_string(void)
 {
 	parse_string();
@@ -170,6 +426,18 @@ static reg_t op_stw(reg_t a, reg_t p, reg_t off)
 	return a;
 }
 
+static reg_t op_stw_rel(reg_t a, reg_t p)
+{
+	__atomic_store_n((reg_t *) (uintptr_t) p, a, __ATOMIC_RELEASE);
+	return a;
+}
+
+static reg_t op_stw_post(reg_t a, reg_t p)
+{
+	*(reg_t *) (uintptr_t) p = a;
+	return a;
+}
+
 static reg_t op_sub(reg_t _, reg_t a, reg_t b)
 {
 	return a - b;
@@ -193,6 +461,16 @@ static reg_t op_words(void)
 	return 0;
 }
 
+static reg_t op_xadd(reg_t _, reg_t p, reg_t n)
+{
+	return __atomic_fetch_add((reg_t *) (uintptr_t) p, n, __ATOMIC_SEQ_CST);
+}
+
+static reg_t op_xchg(reg_t _, reg_t p, reg_t v)
+{
+	return __atomic_exchange_n((reg_t *) (uintptr_t) p, v, __ATOMIC_SEQ_CST);
+}
+
 static reg_t op_xor(reg_t _, reg_t a, reg_t b)
 {
 	return a ^ b;
@@ -200,50 +478,148 @@ static reg_t op_xor(reg_t _, reg_t a, reg_t b)
 
 void register_ops(void)
 {
-#define OP(x)                                                   \
+#define OP_NAMED(n, x)                                          \
 	do {                                                    \
-		static struct symbol s = { .name = #x,          \
+		static struct symbol s = { .name = n,           \
 					   .type = FUNCPTR,     \
 					   { .sym = &op_##x } }; \
 		symtab_add(&s);                                 \
 	} while (0)
+#define OP(x) OP_NAMED(#x, x)
+#define CONST(n, v)                                                     \
+	do {                                                            \
+		static struct symbol s = { .name = n, .type = CONSTANT }; \
+		s.val = (v);                                            \
+		symtab_add(&s);                                         \
+	} while (0)
 #define IMM (symtab_latest()->type = WORDPTR)
+#define INTRINSIC(x) (symtab_latest()->intrinsic = (x))
 
 	OP(add);
 	OP(alloc);
 	OP(assert);
 	OP(and);
 	OP(array); IMM;
+	OP(bswap); INTRINSIC(I_BSWAP);
 	OP(bytes); IMM;
+	OP(cas); INTRINSIC(I_CAS);
+	OP(case); IMM;
+	OP(close);
+	OP(clz); INTRINSIC(I_CLZ);
+	OP(compare);
 	OP(const); IMM;
+	OP(copy);
+	OP(coro); IMM;
+	OP(ctz); INTRINSIC(I_CTZ);
 	OP(define); IMM;
 	OP(disassemble); IMM;
 	OP(div);
+	OP(done);
 	OP(dump);
 	OP(exit);
+	OP(fence); INTRINSIC(I_FENCE);
+	OP(fill);
+	OP(find);
+	OP(flush);
+	OP(forget); IMM;
+	OP(getb);
 	OP(hex);
 	OP(if); IMM;
-	OP(ldb);
-	OP(ldw);
+	OP(join);
+	OP(ldb); INTRINSIC(I_LDB);
+	OP_NAMED("ldb+", ldb_post); INTRINSIC(I_LDB_POST);
+	OP(ldw); INTRINSIC(I_LDW);
+	OP_NAMED("ldw.acq", ldw_acq); INTRINSIC(I_LDW_ACQ);
+	OP_NAMED("ldw+", ldw_post); INTRINSIC(I_LDW_POST);
+	OP(mapfile);
+	OP(maplen);
+	OP(marker); IMM;
+	OP(mkstemp);
 	OP(mov);
 	OP(mul);
+	OP(open);
 	OP(or);
+	OP(pfor);
+	OP(pget);
+	OP(pool); IMM;
+	OP(popcnt); INTRINSIC(I_POPCNT);
+	OP(pput);
+	OP(pread);
 	OP(print);
+	OP(profile); IMM;
+	OP(pstart);
+	OP(pstop);
 	OP(putc);
+	OP(putb);
 	OP(puts);
+	OP(qpop);
+	OP(qpopn);
+	OP(qpush);
+	OP(qpushn);
+	OP(queue); IMM;
+	OP(read);
+	OP(recurse); IMM;
+	OP(resume);
+	OP(rol); INTRINSIC(I_ROL);
+	OP(ror); INTRINSIC(I_ROR);
+	OP(scratch);
+	OP_NAMED("scratch-reset", scratch_reset);
 	OP(shl);
 	OP(shr);
 	OP(shra);
-	OP(stb);
+	OP(spawn);
+	OP(spsc); IMM;
+	OP(stb); INTRINSIC(I_STB);
+	OP_NAMED("stb+", stb_post); INTRINSIC(I_STB_POST);
 	OP(string); IMM;
-	OP(stw);
+	OP(stw); INTRINSIC(I_STW);
+	OP_NAMED("stw.rel", stw_rel); INTRINSIC(I_STW_REL);
+	OP_NAMED("stw+", stw_post); INTRINSIC(I_STW_POST);
 	OP(sub);
+	OP(unlink);
+	OP(unmap);
 	OP(us);
 	OP(var); IMM;
+	OP(vadd);
+	OP(vadds);
+	OP(vand);
+	OP(vands);
+	OP(vmax);
+	OP(vmin);
+	OP(vmul);
+	OP(vmuls);
+	OP(vor);
+	OP(vors);
+	OP(vscan);
+	OP(vsub);
+	OP(vsubs);
+	OP(vsum);
+	OP(vxor);
+	OP(vxors);
 	OP(while); IMM;
 	OP(words);
+	OP(write);
+	OP(xadd); INTRINSIC(I_XADD);
+	OP(xchg); INTRINSIC(I_XCHG);
 	OP(xor);
-
+	OP(yield);
+
+	CONST("O_APPEND", O_APPEND);
+	CONST("O_CREAT", O_CREAT);
+	CONST("O_RDONLY", O_RDONLY);
+	CONST("O_RDWR", O_RDWR);
+	CONST("O_TRUNC", O_TRUNC);
+	CONST("O_WRONLY", O_WRONLY);
+	CONST("P_BRANCH_MISSES", PERF_BRANCH_MISSES);
+	CONST("P_CYCLES", PERF_CYCLES);
+	CONST("P_INSTRUCTIONS", PERF_INSTRUCTIONS);
+	CONST("P_L1D_MISSES", PERF_L1D_MISSES);
+	CONST("P_LLC_MISSES", PERF_LLC_MISSES);
+	CONST("REG64", sizeof(reg_t) == 8);
+
+#undef CONST
 #undef OP
+#undef OP_NAMED
 #undef IMM
+#undef INTRINSIC
 }
@@ -0,0 +1,132 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+/*!
+ * \file perf.c
+ * \brief Hardware performance counters
+ *
+ * `pstart` resets and starts a group of per-thread counters (cycles,
+ * instructions, branch misses, L1D and LLC read misses) and `pstop` stops
+ * them again, returning the cycle count. `pread` then returns one of the
+ * counts accumulated between the two, selected using the P_* constants.
+ * On a 32-bit build the counts are truncated so keep the measured region
+ * short.
+ *
+ * The counters are opened by the first `pstart` on each thread. Counters
+ * the kernel will not let us open (perf_event_paranoid, a hypervisor that
+ * does not virtualize the PMU, ...) simply read as zero and `pstart`
+ * returns the number of counters that are actually running.
+ */
+
+/* syscall() is not part of C99 */
+#define _DEFAULT_SOURCE
+
+#include "eigth.h"
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+struct counters {
+	bool opened;
+	int leader;
+	int fd[NR_PERF_COUNTERS];
+	uint64_t count[NR_PERF_COUNTERS];
+};
+
+static __thread struct counters counters;
+
+static const struct {
+	uint32_t type;
+	uint64_t config;
+} events[NR_PERF_COUNTERS] = {
+	[PERF_CYCLES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	[PERF_INSTRUCTIONS] = { PERF_TYPE_HARDWARE,
+				PERF_COUNT_HW_INSTRUCTIONS },
+	[PERF_BRANCH_MISSES] = { PERF_TYPE_HARDWARE,
+				 PERF_COUNT_HW_BRANCH_MISSES },
+	[PERF_L1D_MISSES] = { PERF_TYPE_HW_CACHE,
+			      PERF_COUNT_HW_CACHE_L1D |
+			      PERF_COUNT_HW_CACHE_OP_READ << 8 |
+			      PERF_COUNT_HW_CACHE_RESULT_MISS << 16 },
+	[PERF_LLC_MISSES] = { PERF_TYPE_HW_CACHE,
+			      PERF_COUNT_HW_CACHE_LL |
+			      PERF_COUNT_HW_CACHE_OP_READ << 8 |
+			      PERF_COUNT_HW_CACHE_RESULT_MISS << 16 },
+};
+
+static int open_counter(int n, int group)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = events[n].type;
+	attr.config = events[n].config;
+	attr.disabled = group < 0;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+static void open_counters(struct counters *c)
+{
+	c->opened = true;
+	c->leader = -1;
+
+	// the first counter we manage to open leads the group, if some
+	// counters are missing we make do with the rest
+	for (int i = 0; i < NR_PERF_COUNTERS; i++) {
+		c->fd[i] = open_counter(i, c->leader);
+		if (c->leader < 0)
+			c->leader = c->fd[i];
+	}
+}
+
+reg_t op_pread(reg_t _, reg_t n)
+{
+	if (n >= NR_PERF_COUNTERS)
+		return 0;
+
+	return counters.count[n];
+}
+
+reg_t op_pstart(reg_t _)
+{
+	struct counters *c = &counters;
+	reg_t running = 0;
+
+	if (!c->opened)
+		open_counters(c);
+
+	for (int i = 0; i < NR_PERF_COUNTERS; i++) {
+		c->count[i] = 0;
+		running += c->fd[i] >= 0;
+	}
+
+	if (c->leader >= 0) {
+		ioctl(c->leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+		ioctl(c->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	}
+
+	return running;
+}
+
+reg_t op_pstop(reg_t _)
+{
+	struct counters *c = &counters;
+
+	if (c->leader < 0)
+		return 0;
+
+	ioctl(c->leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+	for (int i = 0; i < NR_PERF_COUNTERS; i++) {
+		uint64_t v;
+
+		if (c->fd[i] >= 0 && read(c->fd[i], &v, sizeof(v)) == sizeof(v))
+			c->count[i] = v;
+	}
+
+	return c->count[PERF_CYCLES];
+}
@@ -0,0 +1,237 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+/*!
+ * \file profile.c
+ * \brief Per-word profiler
+ *
+ * After `profile on` every word that is defined gets a profile record and
+ * the backends call profile_enter() and profile_exit() from its preamble
+ * and postamble. The hooks count calls and accumulate inclusive time (the
+ * word and everything it calls) and exclusive time (the word itself) read
+ * from a cheap tick counter; the TSC on x86 and the virtual counter on
+ * A64.
+ *
+ * `profile report` prints a table sorted by exclusive time. Words that
+ * were defined while profiling was switched off have no hooks and are
+ * listed separately so that their absence from the table is not mistaken
+ * for them being cheap. `profile off` stops instrumenting new words and
+ * `profile reset` zeros the counts.
+ *
+ * Each thread keeps its own stack of active calls. The counts are updated
+ * atomically so words called from several threads are counted correctly,
+ * but time spent in a coroutine is charged to whichever word resumed it:
+ * when a coroutine yields, the frames it leaves on the stack are simply
+ * discarded by the next exit below them.
+ */
+
+#include "eigth.h"
+#include <time.h>
+
+#define PROFILE_DEPTH 1024
+
+struct profile {
+	code_t *word;
+	uint64_t calls;
+	uint64_t inclusive;
+	uint64_t exclusive;
+	struct profile_frame *outermost;
+	struct profile *next;
+};
+
+struct profile_frame {
+	struct profile *prof;
+	uint64_t start;
+	uint64_t children;
+};
+
+static bool enabled;
+static struct profile *profiles;
+
+static __thread struct profile_frame frames[PROFILE_DEPTH];
+static __thread int depth;
+
+static inline uint64_t ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+	uint64_t t;
+	__asm__ __volatile__("isb; mrs %0, cntvct_el0" : "=r"(t));
+	return t;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+/*!
+ * \brief Allocate a profile record for a word that is about to be defined
+ *
+ * Returns NULL if profiling is not switched on.
+ */
+struct profile *profile_new(code_t *word)
+{
+	struct profile *p;
+
+	if (!enabled)
+		return NULL;
+
+	p = alloc(sizeof(*p));
+	memset(p, 0, sizeof(*p));
+	p->word = word;
+	p->next = profiles;
+	profiles = p;
+
+	return p;
+}
+
+/*!
+ * \brief Forget the records of words that are being released
+ *
+ * Records are allocated in the data region so any that sit at or above
+ * mem are being released too, even if their word is not.
+ */
+void profile_forget(code_t *code, char *mem)
+{
+	struct profile **pp = &profiles;
+
+	while (*pp) {
+		if ((*pp)->word >= code || (char *) *pp >= mem)
+			*pp = (*pp)->next;
+		else
+			pp = &(*pp)->next;
+	}
+}
+
+void profile_enter(struct profile *p)
+{
+	struct profile_frame *f;
+
+	__atomic_fetch_add(&p->calls, 1, __ATOMIC_RELAXED);
+
+	// too deep to time, but we must still keep track of the depth so
+	// that the exits pair up with the right frames
+	if (depth++ >= PROFILE_DEPTH)
+		return;
+
+	f = &frames[depth - 1];
+	f->prof = p;
+	f->children = 0;
+
+	// only the outermost of a set of recursive calls counts towards the
+	// inclusive time, otherwise the time would be counted repeatedly
+	if ((uintptr_t) p->outermost < (uintptr_t) frames ||
+	    (uintptr_t) p->outermost >= (uintptr_t) f)
+		p->outermost = f;
+
+	f->start = ticks();
+}
+
+void profile_exit(struct profile *p)
+{
+	uint64_t now = ticks();
+	struct profile_frame *f;
+	uint64_t elapsed;
+	int i;
+
+	if (depth > PROFILE_DEPTH) {
+		depth--;
+		return;
+	}
+
+	// unwind any frames left by a coroutine that yielded, and ignore the
+	// exit of a coroutine whose frame has been unwound already
+	for (i = depth; i > 0 && frames[i - 1].prof != p; i--)
+		;
+	if (!i)
+		return;
+	while (depth > i) {
+		f = &frames[--depth];
+		if (f->prof->outermost == f)
+			f->prof->outermost = NULL;
+	}
+
+	f = &frames[--depth];
+	elapsed = now - f->start;
+
+	__atomic_fetch_add(&p->exclusive, elapsed - f->children,
+			   __ATOMIC_RELAXED);
+	if (p->outermost == f) {
+		__atomic_fetch_add(&p->inclusive, elapsed, __ATOMIC_RELAXED);
+		p->outermost = NULL;
+	}
+
+	if (depth)
+		f[-1].children += elapsed;
+}
+
+void profile_enable(bool on)
+{
+	enabled = on;
+}
+
+void profile_reset(void)
+{
+	for (struct profile *p = profiles; p; p = p->next)
+		p->calls = p->inclusive = p->exclusive = 0;
+}
+
+static bool profiled(code_t *word)
+{
+	for (struct profile *p = profiles; p; p = p->next)
+		if (p->word == word)
+			return true;
+
+	return false;
+}
+
+static int by_exclusive(const void *a, const void *b)
+{
+	const struct profile *p = *(const struct profile **) a;
+	const struct profile *q = *(const struct profile **) b;
+
+	return p->exclusive < q->exclusive ? 1 :
+	       p->exclusive > q->exclusive ? -1 : 0;
+}
+
+void profile_report(FILE *f)
+{
+	struct profile **sorted;
+	size_t n = 0;
+	bool header = false;
+
+	for (struct profile *p = profiles; p; p = p->next)
+		n++;
+
+	sorted = malloc(n * sizeof(*sorted) + 1);
+	if (!sorted)
+		die("Cannot allocate profile report");
+	n = 0;
+	for (struct profile *p = profiles; p; p = p->next)
+		sorted[n++] = p;
+	qsort(sorted, n, sizeof(*sorted), by_exclusive);
+
+	fprintf(f, "%12s %16s %16s  %s\n", "calls", "self", "total", "word");
+	for (size_t i = 0; i < n; i++) {
+		const char *name = symtab_name((uintptr_t) sorted[i]->word);
+
+		fprintf(f, "%12" PRIu64 " %16" PRIu64 " %16" PRIu64 "  %s\n",
+			sorted[i]->calls, sorted[i]->exclusive,
+			sorted[i]->inclusive, name ? name : "?");
+	}
+	free(sorted);
+
+	// words that were compiled without the hooks
+	for (struct symbol *s = symtab_latest(); s; s = s->next) {
+		if (s->type != EXECPTR || !in_code(s->val) ||
+		    profiled((code_t *) (uintptr_t) s->val))
+			continue;
+
+		if (!header)
+			fprintf(f, "not profiled (defined with profile off):\n");
+		header = true;
+		fprintf(f, "    %s\n", s->name);
+	}
+}
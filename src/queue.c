@@ -0,0 +1,167 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+/*!
+ * \file queue.c
+ * \brief Lock-free ring buffer queues
+ *
+ * Queues are created by `queue` (multi-producer/multi-consumer) or `spsc`
+ * (single-producer/single-consumer). Push and pop never block, instead
+ * they return zero if the queue is full (or empty) so that the caller can
+ * decide whether to spin, yield or do something else.
+ *
+ * The multi-producer queue is a bounded MPMC queue in the style described
+ * by Dmitry Vyukov: producers and consumers claim a position with a CAS
+ * and a per-slot sequence number tells them whether the slot is ready.
+ *
+ * The batched forms (qpushn and qpopn) move as many values as they can
+ * and return how many were moved. For single producer queues this
+ * publishes the whole batch with a single store to the shared index.
+ */
+
+#include "eigth.h"
+
+static inline struct queue *queue(reg_t q)
+{
+	return (struct queue *) (uintptr_t) q;
+}
+
+static inline reg_t load_acquire(reg_t *p)
+{
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void store_release(reg_t *p, reg_t v)
+{
+	__atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+static reg_t mpmc_push(struct queue *q, const reg_t *v, reg_t n)
+{
+	struct queue_slot *slots = (struct queue_slot *) (uintptr_t) q->slots;
+	reg_t i;
+
+	for (i = 0; i < n; i++) {
+		reg_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+		struct queue_slot *slot;
+
+		for (;;) {
+			slot = &slots[pos & q->mask];
+			sreg_t diff = load_acquire(&slot->seq) - pos;
+
+			if (diff == 0) {
+				if (__atomic_compare_exchange_n(
+					    &q->tail, &pos, pos + 1, true,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+					break;
+			} else if (diff < 0) {
+				return i; // full
+			} else {
+				pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+			}
+		}
+
+		slot->val = v[i];
+		store_release(&slot->seq, pos + 1);
+	}
+
+	return i;
+}
+
+static reg_t mpmc_pop(struct queue *q, reg_t *v, reg_t n)
+{
+	struct queue_slot *slots = (struct queue_slot *) (uintptr_t) q->slots;
+	reg_t i;
+
+	for (i = 0; i < n; i++) {
+		reg_t pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+		struct queue_slot *slot;
+
+		for (;;) {
+			slot = &slots[pos & q->mask];
+			sreg_t diff = load_acquire(&slot->seq) - (pos + 1);
+
+			if (diff == 0) {
+				if (__atomic_compare_exchange_n(
+					    &q->head, &pos, pos + 1, true,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+					break;
+			} else if (diff < 0) {
+				return i; // empty
+			} else {
+				pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+			}
+		}
+
+		v[i] = slot->val;
+		store_release(&slot->seq, pos + q->mask + 1);
+	}
+
+	return i;
+}
+
+static reg_t spsc_push(struct queue *q, const reg_t *v, reg_t n)
+{
+	reg_t *slots = (reg_t *) (uintptr_t) q->slots;
+	reg_t tail = q->tail;
+	reg_t space = q->mask + 1 - (tail - q->head_cache);
+
+	if (space < n) {
+		q->head_cache = load_acquire(&q->head);
+		space = q->mask + 1 - (tail - q->head_cache);
+	}
+	if (n > space)
+		n = space;
+
+	for (reg_t i = 0; i < n; i++)
+		slots[(tail + i) & q->mask] = v[i];
+	store_release(&q->tail, tail + n);
+
+	return n;
+}
+
+static reg_t spsc_pop(struct queue *q, reg_t *v, reg_t n)
+{
+	reg_t *slots = (reg_t *) (uintptr_t) q->slots;
+	reg_t head = q->head;
+	reg_t avail = q->tail_cache - head;
+
+	if (avail < n) {
+		q->tail_cache = load_acquire(&q->tail);
+		avail = q->tail_cache - head;
+	}
+	if (n > avail)
+		n = avail;
+
+	for (reg_t i = 0; i < n; i++)
+		v[i] = slots[(head + i) & q->mask];
+	store_release(&q->head, head + n);
+
+	return n;
+}
+
+reg_t op_qpop(reg_t _, reg_t q, reg_t out)
+{
+	return op_qpopn(_, q, out, 1);
+}
+
+reg_t op_qpopn(reg_t _, reg_t q, reg_t p, reg_t n)
+{
+	reg_t *v = (reg_t *) (uintptr_t) p;
+
+	return queue(q)->mpmc ? mpmc_pop(queue(q), v, n) :
+				spsc_pop(queue(q), v, n);
+}
+
+reg_t op_qpush(reg_t _, reg_t q, reg_t v)
+{
+	return queue(q)->mpmc ? mpmc_push(queue(q), &v, 1) :
+				spsc_push(queue(q), &v, 1);
+}
+
+reg_t op_qpushn(reg_t _, reg_t q, reg_t p, reg_t n)
+{
+	const reg_t *v = (const reg_t *) (uintptr_t) p;
+
+	return queue(q)->mpmc ? mpmc_push(queue(q), v, n) :
+				spsc_push(queue(q), v, n);
+}
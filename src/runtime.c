@@ -7,65 +7,353 @@
 #define _DEFAULT_SOURCE
 
 #include "eigth.h"
+#include <pthread.h>
 #include <time.h>
 #include <sys/mman.h>
+#include <unistd.h>
 
 enum delimiter {
 	END,
-	ELSE
+	ELSE,
+	OF,
+	DEFAULT
 };
 
-static reg_t *memp;
-static reg_t *ip;
+static code_t *ip;
+static code_t *defining; // entry point of the word being defined
+static struct tier *recording; // commands retained for tiered execution
+static struct command of; // the "of" that ended the last block
+
+//
+// Core memory is split into two regions. The code region holds generated
+// code (and the out-of-band area) and pages within it are remapped
+// read/execute once the words they contain have been finalized. The data
+// region holds everything else (strings, symbols, arrays, ...) together
+// with the stack, which grows down from the top of the region.
+//
+#define CORE_BASE 0x04000000
+
+const static unsigned int memsz = 4 * 1024 * 1024;
+const static unsigned int codesz = 1024 * 1024;
+const static unsigned int stacksz = 64 * 1024;
+const static unsigned int scratchsz = 256 * 1024;
+
+static uintptr_t pagesz;
+
+static code_t *codep; // next free word in the code region
+static code_t *codend;
+static code_t *sealp; // code below this point is mapped read/execute
+static char *memp; // next free byte in the data region
+static char *memend;
+static char *scratch; // scratch region (sits between data and stack)
+static char *scratchp;
+static pthread_mutex_t core_lock = PTHREAD_MUTEX_INITIALIZER;
 
 //
 // Out-of-band area must contain space for the canary and either:
 //
-//  * a worst-case four argument call
-//    - VM: 44 = 2 * reg2reg, 3 * imm2reg, call, ret
+//  * a batch of top-level commands (see run_batch()), which is cut short
+//    once there is less than OOB_SLACK words left
 //  * a 9-deep stack of immediate calls
 //    - VM:  108 = call, ret
 //
-static reg_t *oob; // out-of-band exec area
-static reg_t *ooip;
-#define OOB_AREA 32
+// The out-of-band area has the first page of the code region to itself so
+// that it is never sealed.
+//
+static code_t *oob; // out-of-band exec area
+static code_t *ooip;
+static code_t *batch; // end of the top-level commands waiting to run
+static pthread_t parser; // the only thread that may touch the batch
+#define OOB_AREA 512
+#define OOB_SLACK 64
 #define SET_OOB_CANARY() (oob[OOB_AREA - 1] = 0xc0ffee)
 #define CHECK_OOB_CANARY() assert(oob[OOB_AREA - 1] == 0xc0ffee)
 
 static struct symbol *globals = NULL;
 
-const static unsigned int memsz = 4 * 1024 * 1024;
-
 static inline void sync_caches(void *begin, void *end)
 {
-	__builtin___clear_cache((char *) 0x04000000, (char *) 0x04000000 + memsz);
+	__builtin___clear_cache(begin, end);
+}
+
+//
+// Compile statistics (enabled by --stats). The time spent tokenizing,
+// looking up symbols and assembling words is accumulated separately and
+// reported at exit.
+//
+static bool stats;
+static struct {
+	uint64_t start;
+	uint64_t tokenize;
+	uint64_t lookup;
+	uint64_t assemble;
+	unsigned long lines;
+	unsigned long tokens;
+	unsigned long lookups;
+	unsigned long words;
+	code_t *code;
+} compile_stats;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void print_stats(void)
+{
+	double total = (now_ns() - compile_stats.start) / 1e9;
+
+	io_flush();
+	fprintf(stderr, "%lu lines in %.3fs (%.0f lines/sec)\n",
+		compile_stats.lines, total, compile_stats.lines / total);
+	fprintf(stderr, "  tokenize %10.3fms %10lu tokens\n",
+		compile_stats.tokenize / 1e6, compile_stats.tokens);
+	fprintf(stderr, "  lookup   %10.3fms %10lu lookups\n",
+		compile_stats.lookup / 1e6, compile_stats.lookups);
+	fprintf(stderr, "  assemble %10.3fms %10lu words\n",
+		compile_stats.assemble / 1e6, compile_stats.words);
+	fprintf(stderr, "  %zu bytes of code\n",
+		(char *) codep - (char *) compile_stats.code);
+}
+
+static code_t *emit_word(code_t *ip, struct command *cmd)
+{
+	uint64_t t;
+
+	if (!stats)
+		return assemble_word(ip, cmd);
+
+	t = now_ns();
+	ip = assemble_word(ip, cmd);
+	compile_stats.assemble += now_ns() - t;
+	compile_stats.words++;
+
+	return ip;
+}
+
+void *alloc_aligned(size_t sz, size_t align)
+{
+	pthread_mutex_lock(&core_lock);
+	uintptr_t p = ((uintptr_t) memp + align - 1) & ~(uintptr_t) (align - 1);
+	uintptr_t q = p + ((sz + sizeof(reg_t) - 1) & ~(sizeof(reg_t) - 1));
+
+	if (q > (uintptr_t) memend) {
+		pthread_mutex_unlock(&core_lock);
+		die("Out of core memory");
+	}
+	memp = (char *) q;
+	pthread_mutex_unlock(&core_lock);
+
+	return (void *) p;
 }
 
 void *alloc(size_t sz)
 {
-	reg_t *p = (reg_t *) (uintptr_t) memp;
-	reg_t *q = p + (sz + sizeof(reg_t) - 1) / sizeof(reg_t);
-	memp = /*(reg_t) ( uintptr_t)*/ q;
+	return alloc_aligned(sz, sizeof(reg_t));
+}
+
+/*
+ * The scratch region is a second bump allocator whose allocations can all
+ * be discarded at once, allowing temporary buffers to be reused without
+ * leaking core memory.
+ */
+void *scratch_alloc(size_t sz)
+{
+	pthread_mutex_lock(&core_lock);
+	char *p = scratchp;
+	char *q = p + ((sz + CACHELINE - 1) & ~(size_t) (CACHELINE - 1));
+
+	if (q > scratch + scratchsz) {
+		pthread_mutex_unlock(&core_lock);
+		die("Out of scratch memory");
+	}
+	scratchp = q;
+	pthread_mutex_unlock(&core_lock);
 
 	return p;
 }
 
-static reg_t* alloc_memp()
+void scratch_reset(void)
 {
-	void *p = mmap((void *)0x04000000, memsz,
-		       PROT_EXEC | PROT_READ | PROT_WRITE,
+	pthread_mutex_lock(&core_lock);
+	scratchp = scratch;
+	pthread_mutex_unlock(&core_lock);
+}
+
+static void *map_region(uintptr_t base, size_t sz, int prot)
+{
+	void *p = mmap((void *) base, sz, prot,
 		       MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1,
 		       0);
-	if (!p)
-		die("Cannot allocated core memory\n");
+	if (p == MAP_FAILED)
+		die("Cannot allocate core memory");
+
+	return p;
+}
+
+static void alloc_core(void)
+{
+	pagesz = sysconf(_SC_PAGESIZE);
+
+	oob = map_region(CORE_BASE, codesz,
+			 PROT_EXEC | PROT_READ | PROT_WRITE);
+	codep = sealp = oob + pagesz / sizeof(code_t);
+	codend = oob + codesz / sizeof(code_t);
+
+	memp = map_region(CORE_BASE + codesz, memsz - codesz,
+			  PROT_READ | PROT_WRITE);
+	memend = memp + memsz - codesz - stacksz - scratchsz;
+	scratch = scratchp = memend;
+	set_sp(CORE_BASE + memsz);
+}
+
+bool in_code(uintptr_t p)
+{
+	return p >= (uintptr_t) oob && p < (uintptr_t) codend;
+}
+
+static bool in_data(uintptr_t p)
+{
+	return p >= CORE_BASE + codesz && p < (uintptr_t) memend;
+}
+
+/*
+ * Remap any pages that are now completely filled with finalized code as
+ * read/execute. Failure is harmless (the pages just stay writable) so
+ * errors are ignored.
+ */
+static void seal_code(void)
+{
+	uintptr_t end = (uintptr_t) codep & ~(pagesz - 1);
+
+	if (end <= (uintptr_t) sealp)
+		return;
 
-	return /*(reg_t) (uintptr_t)*/ p;
+	if (0 == mprotect(sealp, end - (uintptr_t) sealp,
+			  PROT_READ | PROT_EXEC))
+		sealp = (code_t *) end;
+}
+
+/*
+ * Make any sealed pages at or above code writable again.
+ */
+static void unseal_code(code_t *code)
+{
+	uintptr_t begin = (uintptr_t) code & ~(pagesz - 1);
+
+	if (begin >= (uintptr_t) sealp)
+		return;
+
+	if (0 != mprotect((void *) begin, (uintptr_t) sealp - begin,
+			  PROT_EXEC | PROT_READ | PROT_WRITE))
+		die("Cannot unseal code memory");
+	sealp = (code_t *) begin;
+}
+
+/*
+ * Roll the core back to an earlier state, releasing all the code, data
+ * and symbols that were allocated since.
+ */
+static void rewind_core(code_t *code, char *mem, struct symbol *syms)
+{
+	assert(code <= codep);
+
+	tier_forget(code);
+	profile_forget(code, mem);
+	unseal_code(code);
+	codep = code;
+
+	// other threads may be allocating
+	pthread_mutex_lock(&core_lock);
+	assert(mem <= memp);
+	memp = mem;
+	pthread_mutex_unlock(&core_lock);
+
+	globals = syms;
+}
+
+/*
+ * Claim the code between begin and end (which must start at codep) as
+ * the body of a newly finalized word.
+ */
+static void commit_code(code_t *begin, code_t *end)
+{
+	assert(begin == codep);
+	if (end > codend)
+		die("Out of code memory");
+
+	sync_caches(begin, end);
+	codep = end;
+	seal_code();
+}
+
+/*
+ * Check there is room for words of code at ip, which must be in the code
+ * region above codep (the out-of-band area always has room).
+ */
+bool code_room(code_t *ip, size_t words)
+{
+	return ip < codep || (size_t) (codend - ip) >= words;
+}
+
+/*
+ * Make sure the code assembled next cannot run past the end of the code
+ * region into the data region.
+ */
+static void reserve_code(size_t words)
+{
+	if (!code_room(ip, words))
+		die("Out of code memory");
+}
+
+/*
+ * Generate code outside of the parser (see tier.c). Returns NULL if the
+ * parser is part way through a definition.
+ */
+code_t *code_begin(void)
+{
+	return defining ? NULL : codep;
+}
+
+void code_end(code_t *begin, code_t *end)
+{
+	commit_code(begin, end);
+}
+
+/*
+ * Consecutive top-level commands are assembled into a single chunk of
+ * straight-line code in the out-of-band area and run together, rather
+ * than paying the setup for every line. The batch is run before anything
+ * that might depend on its side effects: an immediate word, an error and
+ * the end of the input. Markers change the symbol table when they run so
+ * they end a batch too.
+ */
+static void run_batch(void)
+{
+	if (!batch)
+		return;
+
+	ooip = assemble_postamble(batch, NULL, 0, NULL);
+	batch = NULL;
+
+	CHECK_OOB_CANARY();
+	sync_caches(oob, ooip);
+	exec(oob);
 }
 
 void die(const char *fmt, ...)
 {
 	va_list ap;
 
+	// make sure any output so far appears before the error message (the
+	// batch can only be run by the parser, not by spawn or pfor threads)
+	if (pthread_equal(pthread_self(), parser))
+		run_batch();
+	io_flush();
+
 	va_start(ap, fmt);
 	vfprintf(stderr, fmt, ap);
 	va_end(ap);
@@ -139,9 +427,8 @@ static void skip_whitespace(void) {
 	}
 }
 
-static char *token(char *p, size_t sz)
+static char *read_token(char *p, size_t sz)
 {
-
 	int c;
 	char *q = p;
 	char *r = q + sz - 1;
@@ -187,10 +474,25 @@ static char *token(char *p, size_t sz)
 	return p[0] ? p : NULL;
 }
 
+static char *token(char *p, size_t sz)
+{
+	uint64_t t;
+
+	if (!stats)
+		return read_token(p, sz);
+
+	t = now_ns();
+	p = read_token(p, sz);
+	compile_stats.tokenize += now_ns() - t;
+	compile_stats.tokens += !!p;
+
+	return p;
+}
+
 static reg_t parse_number(char *p)
 {
 	char *q;
-	long long n = strtoll(p, &q, 0);
+	unsigned long long n = strtoull(p, &q, 0);
 	if (p == q) {
 		return (reg_t) -1;
 	}
@@ -243,6 +545,13 @@ static struct operand parse_operand(char *p)
 		if (sym && sym->type == CONSTANT) {
 			op.type = IMMEDIATE;
 			op.value = sym->val;
+		} else if (!sym && p[0] == '&') {
+			// the address of a word (to pass to spawn, etc)
+			sym = symtab_lookup(p + 1);
+			if (sym && sym->type == EXECPTR) {
+				op.type = IMMEDIATE;
+				op.value = sym->val;
+			}
 		}
 	}
 
@@ -252,6 +561,7 @@ static struct operand parse_operand(char *p)
 // Consuming symbols until we reach the end
 void parse_error(void)
 {
+	run_batch();
 	fprintf(stderr, "Parse error - aborting\n");
 	exit(1);
 }
@@ -276,8 +586,10 @@ static struct command parse_command(void) {
 	if (!t) {
 		switch (getchar()) {
 		case '\n':
+			compile_stats.lines++;
 			return parse_command();
 		case EOF:
+			run_batch();
 			exit(0);
 		default:
 			assert(false);
@@ -295,6 +607,7 @@ static struct command parse_command(void) {
 	/* final consistency check */
 	switch(getchar()) {
 		case '\n':
+			compile_stats.lines++;
 			break;
 		case EOF:
 			die("Unexpected end of file");
@@ -323,12 +636,20 @@ static uint8_t get_clobbers(struct command *cmd)
 enum delimiter parse_block(void)
 {
 	while (true) {
+		reserve_code(CODE_SLACK);
+
 		struct command c = parse_command();
 		if (!c.sym) {
 			if (0 == strcmp(c.opcode, "end"))
 				return END;
 			else if (0 == strcmp(c.opcode, "else"))
 				return ELSE;
+			else if (0 == strcmp(c.opcode, "of")) {
+				of = c;
+				return OF;
+			} else if (0 == strcmp(c.opcode, "default")) {
+				return DEFAULT;
+			}
 
 			parse_error();
 			return END;
@@ -336,16 +657,17 @@ enum delimiter parse_block(void)
 
 		if (c.sym->type == WORDPTR) {
 			// execute the word immediately
-			reg_t *word = ooip;
-			ooip = assemble_preamble(ooip, NULL, 0);
-			ooip = assemble_word(ooip, &c);
-			ooip = assemble_postamble(ooip, NULL, 0);
+			code_t *word = ooip;
+			ooip = assemble_preamble(ooip, NULL, 0, NULL);
+			ooip = emit_word(ooip, &c);
+			ooip = assemble_postamble(ooip, NULL, 0, NULL);
 
 			CHECK_OOB_CANARY();
 			sync_caches(word, ooip);
 			exec(word);
 		} else {
-			ip = assemble_word(ip, &c);
+			ip = emit_word(ip, &c);
+			tier_record(recording, IR_WORD, &c, NULL);
 		}
 	}
 }
@@ -364,20 +686,48 @@ void parse_define(void)
 			clobbers |= get_clobbers(&use);
 	} while (0 != strcmp(use.opcode, "begin"));
 
-	reg_t *p = /*(reg_t *)(uintptr_t)*/memp;
+	code_t *p = codep;
 	ip = p;
+	reserve_code(CODE_SLACK);
+
+	struct profile *prof = profile_new(p);
 
-	ip = assemble_preamble(ip, &cmd, clobbers);
+	defining = p;
+	recording = tier_new(p, &cmd, clobbers);
+	if (recording)
+		ip = backend->assemble_tier(ip, recording);
+	ip = assemble_preamble(ip, &cmd, clobbers, prof);
 	(void) parse_block();
-	ip = assemble_postamble(ip, &cmd, clobbers);
-	sync_caches(p, ip);
+	ip = assemble_postamble(ip, &cmd, clobbers, prof);
+	recording = NULL;
+	defining = NULL;
 
 	// allocate the space for the freshly assembled function!
-	memp = /*(reg_t) (uintptr_t)*/ ip;
+	commit_code(p, ip);
 
 	(void) symtab_new(cmd.opcode, EXECPTR, (reg_t) (uintptr_t) p);
 }
 
+/*!
+ * \brief Call the word currently being defined
+ *
+ * A word is only added to the symbol table once its definition is
+ * complete so it cannot call itself by name.
+ */
+void parse_recurse(void)
+{
+	static struct symbol self = { .name = "recurse", .type = EXECPTR };
+	struct command cmd = { .opcode = "recurse", .sym = &self };
+
+	if (!defining)
+		die("recurse: not inside a definition");
+
+	parse_operands(cmd.operand, lengthof(cmd.operand));
+	self.val = (reg_t) (uintptr_t) defining;
+	ip = emit_word(ip, &cmd);
+	tier_record(recording, IR_RECURSE, &cmd, NULL);
+}
+
 enum relop parse_relop(const char *t)
 {
 	if (!t)
@@ -423,20 +773,25 @@ struct compare parse_comparison(void)
 
 void parse_const_if(reg_t condition)
 {
-	reg_t *oip = ip;
+	code_t *oip = ip;
+	size_t mark = tier_mark(recording);
 
 	enum delimiter delim = parse_block();
 	if (condition && delim == ELSE) {
 		oip = ip;
+		mark = tier_mark(recording);
 		(void) parse_block();
 		ip = oip;
+		tier_rewind(recording, mark);
 	} else if (delim == ELSE) {
 		ip = oip;
+		tier_rewind(recording, mark);
 		(void) parse_block();
 	} else if (!condition) {
 		// rewind everything (this is an `if 0` used to comment out
 		// a block of code)
 		ip = oip;
+		tier_rewind(recording, mark);
 	}
 
 }
@@ -450,16 +805,69 @@ void parse_if(void)
 		return parse_error();
 	}
 
-	reg_t *fixme;
+	code_t *fixme;
 
 	ip = assemble_if(ip, &cmp, &fixme);
+	tier_record(recording, IR_IF, NULL, &cmp);
 	enum delimiter delim = parse_block();
 	if (delim == ELSE) {
 		ip = assemble_else(ip, &fixme);
+		tier_record(recording, IR_ELSE, NULL, NULL);
 		(void) parse_block();
 	}
 	fixup_if(ip, fixme);
+	tier_record(recording, IR_ENDIF, NULL, NULL);
+
+}
+
+void parse_case(void)
+{
+	char buf[32];
+	struct command sel = { .opcode = "case" };
+	struct case_block c;
+	enum delimiter delim;
+	code_t *start;
+
+	sel.operand[0] = parse_operand(token(buf, sizeof(buf)));
+	if (sel.operand[0].type != REGISTER)
+		return parse_error();
+
+	ip = case_begin(backend, ip, &c, sel.operand[0].value);
+	tier_record(recording, IR_CASE, &sel, NULL);
+
+	// anything before the first "of" could never run
+	start = ip;
+	delim = parse_block();
+	if (ip != start)
+		return parse_error();
 
+	while (delim != END) {
+		ip = case_section(backend, ip, &c);
+		if (delim == OF) {
+			struct command values = of;
+
+			if (values.operand[0].type != IMMEDIATE)
+				return parse_error();
+			for (int i = 0; i < lengthof(values.operand) &&
+					values.operand[i].type != INVALID;
+			     i++) {
+				if (values.operand[i].type != IMMEDIATE)
+					return parse_error();
+				case_of(&c, values.operand[i].value, ip);
+			}
+			tier_record(recording, IR_OF, &values, NULL);
+		} else if (delim == DEFAULT) {
+			case_default(&c, ip);
+			tier_record(recording, IR_DEFAULT, NULL, NULL);
+		} else {
+			return parse_error();
+		}
+		delim = parse_block();
+	}
+
+	reserve_code(CODE_SLACK + CASE_SLACK * c.nlabels);
+	ip = case_end(backend, ip, &c);
+	tier_record(recording, IR_ENDCASE, NULL, NULL);
 }
 
 void generate_addressof(const char *opcode, reg_t *val)
@@ -483,7 +891,7 @@ void parse_array(void)
 	// TODO: error checking...
 
 	const size_t sz = cmd.operand[0].value * sizeof(reg_t);
-	reg_t *r = alloc(sz);
+	reg_t *r = alloc_aligned(sz, CACHELINE);
 	memset(r, 0, sz);
 
 	generate_addressof(cmd.opcode, r);
@@ -513,16 +921,210 @@ void parse_const(void)
 	(void) symtab_new(cmd.opcode, CONSTANT, cmd.operand[0].value);
 }
 
+void parse_forget(void)
+{
+	struct command cmd = parse_command();
+	struct symbol *s = cmd.sym;
+
+	if (!s || !in_data((uintptr_t) s)) {
+		fprintf(stderr, "Cannot forget: %s\n", cmd.opcode);
+		return;
+	}
+
+	// Find the oldest memory belonging to s or anything defined after it.
+	// Symbols records are allocated after the data they describe so we
+	// must also look at where code and address-of constants point.
+	code_t *code = codep;
+	char *mem = (char *) s->name;
+	for (struct symbol *t = globals; t != s->next; t = t->next) {
+		if (t->type == EXECPTR && in_code(t->val) &&
+		    (code_t *) (uintptr_t) t->val < code)
+			code = (code_t *) (uintptr_t) t->val;
+		if (t->type == CONSTANT && in_data(t->val) &&
+		    (char *) (uintptr_t) t->val < mem)
+			mem = (char *) (uintptr_t) t->val;
+		if (in_data((uintptr_t) t->name) && (char *) t->name < mem)
+			mem = (char *) t->name;
+	}
+
+	rewind_core(code, mem, s->next);
+}
+
+struct marker {
+	code_t *codep;
+	char *memp;
+	struct symbol *globals;
+};
+
+static reg_t restore_marker(reg_t m)
+{
+	struct marker *mark = (struct marker *) (uintptr_t) m;
+
+	// rewinding releases mark itself so don't touch it afterwards
+	rewind_core(mark->codep, mark->memp, mark->globals);
+	return 0;
+}
+
+void parse_marker(void)
+{
+	struct command cmd = parse_command();
+
+	// take the snapshot before we allocate anything for the marker itself
+	// so that executing the marker forgets it too
+	pthread_mutex_lock(&core_lock);
+	struct marker snapshot = { codep, memp, globals };
+	pthread_mutex_unlock(&core_lock);
+	struct marker *mark = alloc(sizeof(*mark));
+	*mark = snapshot;
+
+	static struct symbol restore = { .name = "restore_marker",
+					 .type = FUNCPTR,
+					 { .sym = &restore_marker } };
+	struct command call = {
+		.opcode = "restore_marker",
+		.sym = &restore,
+		.operand = {
+			{ IMMEDIATE, (reg_t) (uintptr_t) mark },
+		}
+	};
+
+	code_t *p;
+
+	p = ip = codep;
+	reserve_code(CODE_SLACK);
+	ip = assemble_preamble(ip, NULL, 0, NULL);
+	ip = emit_word(ip, &call);
+	ip = assemble_postamble(ip, NULL, 0, NULL);
+	commit_code(p, ip);
+	symtab_new(cmd.opcode, EXECPTR, (reg_t) (uintptr_t) p)->rewinds = true;
+}
+
+void parse_coro(void)
+{
+	struct command cmd = parse_command();
+	reg_t word = cmd.operand[0].value;
+	reg_t stacksz = cmd.operand[1].value;
+
+	if (cmd.operand[0].type != IMMEDIATE || !in_code(word) ||
+	    cmd.operand[1].type != IMMEDIATE || !stacksz)
+		return parse_error();
+
+	stacksz = (stacksz + 15) & ~(reg_t) 15;
+	generate_addressof(cmd.opcode, (reg_t *) coro_new(word, stacksz));
+}
+
+void parse_pool(void)
+{
+	// a command is not expected right now, instead this is just a sneaky
+	// bit of code reuse to collect a name and two numbers from the input.
+	struct command cmd = parse_command();
+	reg_t objsize = cmd.operand[0].value;
+	reg_t count = cmd.operand[1].value;
+
+	if (cmd.operand[0].type != IMMEDIATE ||
+	    cmd.operand[1].type != IMMEDIATE || !count)
+		return parse_error();
+
+	// every object must be big enough (and aligned) to hold the link
+	if (objsize < sizeof(reg_t))
+		objsize = sizeof(reg_t);
+	objsize = (objsize + sizeof(reg_t) - 1) & ~(reg_t) (sizeof(reg_t) - 1);
+
+	// the rounding above wraps to zero for sizes close to the limit
+	if (!objsize || count > (reg_t) -1 / objsize)
+		return parse_error();
+
+	struct pool *pool = alloc(sizeof(*pool));
+	char *slab = alloc_aligned(objsize * count, CACHELINE);
+
+	pool->objsize = objsize;
+	pool->base = (reg_t) (uintptr_t) slab;
+	pool->limit = pool->base + objsize * count;
+	pool->free = 0;
+
+	// thread the free list so the lowest addresses are handed out first
+	for (reg_t obj = pool->limit; obj != pool->base;) {
+		obj -= objsize;
+#ifdef POOL_POISON
+		memset((char *) (uintptr_t) obj, POOL_POISON_BYTE, objsize);
+#endif
+		*(reg_t *) (uintptr_t) obj = pool->free;
+		pool->free = obj;
+	}
+
+	generate_addressof(cmd.opcode, (reg_t *) pool);
+}
+
+void parse_profile(void)
+{
+	// collect the sub-command (on, off, report or reset)
+	struct command cmd = parse_command();
+
+	if (0 == strcmp(cmd.opcode, "on"))
+		profile_enable(true);
+	else if (0 == strcmp(cmd.opcode, "off"))
+		profile_enable(false);
+	else if (0 == strcmp(cmd.opcode, "report"))
+		profile_report(stdout);
+	else if (0 == strcmp(cmd.opcode, "reset"))
+		profile_reset();
+	else
+		parse_error();
+}
+
+void parse_queue(bool mpmc)
+{
+	struct command cmd = parse_command();
+	reg_t capacity = cmd.operand[0].value;
+
+	if (cmd.operand[0].type != IMMEDIATE || !capacity ||
+	    capacity > (reg_t) 1 << (REG_BITS - 2))
+		return parse_error();
+
+	// round up to a power of two so indices can be masked
+	while (capacity & (capacity - 1))
+		capacity += capacity & -capacity;
+
+	// with a single slot the sequence number a full slot waits at is the
+	// same as the one the next producer expects, so MPMC needs two
+	if (mpmc && capacity < 2)
+		capacity = 2;
+
+	struct queue *q = alloc_aligned(sizeof(*q), CACHELINE);
+	size_t slotsz = mpmc ? sizeof(struct queue_slot) : sizeof(reg_t);
+	char *slots = alloc_aligned(slotsz * capacity, CACHELINE);
+
+	memset(q, 0, sizeof(*q));
+	q->mask = capacity - 1;
+	q->mpmc = mpmc;
+	q->slots = (reg_t) (uintptr_t) slots;
+
+	// each slot starts out ready for the producer with the same index
+	if (mpmc) {
+		struct queue_slot *slot = (struct queue_slot *) slots;
+		for (reg_t i = 0; i < capacity; i++)
+			slot[i].seq = i;
+	}
+
+	generate_addressof(cmd.opcode, (reg_t *) q);
+}
+
 void parse_string(void)
 {
 	char sym[32];
+	char buf[4096];
 
+	// other threads may be allocating so the string cannot be read
+	// straight into the free memory
 	token(sym, sizeof(sym));
-	char *t = (char *) token((char *) memp, 4096);
-	reg_t *r = alloc(strlen(t) + 1);
-	assert((void *) t == (void *) r);
+	const char *t = token(buf, sizeof(buf));
+	if (!t)
+		return parse_error();
 
-	generate_addressof(sym, r);
+	char *r = alloc(strlen(t) + 1);
+	strcpy(r, t);
+
+	generate_addressof(sym, (reg_t *) r);
 }
 
 void parse_var(void)
@@ -532,7 +1134,7 @@ void parse_var(void)
 	struct command cmd = parse_command();
 	// TODO: error checking...
 
-	reg_t *r = alloc(4);
+	reg_t *r = alloc(sizeof(reg_t));
 	*r = cmd.operand[0].value;
 
 	struct command mov = {
@@ -553,17 +1155,17 @@ void parse_var(void)
 		}
 	};
 
-	reg_t *p;
+	code_t *p;
 
 	// TODO: symtab_new_start() and symtab_new_finalize() would be a better
 	//       interface?
-	p = ip = memp;
-	ip = assemble_preamble(ip, NULL, 0);
-	ip = assemble_word(ip, &mov);
-	ip = assemble_word(ip, &ldw);
-	ip = assemble_postamble(ip, NULL, 0);
-	sync_caches(p, ip);
-	memp = ip;
+	p = ip = codep;
+	reserve_code(CODE_SLACK);
+	ip = assemble_preamble(ip, NULL, 0, NULL);
+	ip = emit_word(ip, &mov);
+	ip = emit_word(ip, &ldw);
+	ip = assemble_postamble(ip, NULL, 0, NULL);
+	commit_code(p, ip);
 	(void) symtab_new(cmd.opcode, EXECPTR, (reg_t) (uintptr_t) p);
 
 	generate_addressof(cmd.opcode, r);
@@ -576,11 +1178,13 @@ void parse_while(void)
 	if (cmp.op1.type != REGISTER)
 		return parse_error();
 
-	reg_t *fixme;
+	code_t *fixme;
 
 	ip = assemble_while(ip, &cmp, &fixme);
+	tier_record(recording, IR_WHILE, NULL, &cmp);
 	(void) parse_block();
 	ip = assemble_endwhile(ip, fixme);
+	tier_record(recording, IR_ENDWHILE, NULL, NULL);
 }
 
 void symtab_add(struct symbol *s)
@@ -607,7 +1211,7 @@ void symtab_disassemble(void)
 	struct command c = parse_command();
 	struct symbol *s = c.sym;
 	if (s && s->type == EXECPTR)
-		disassemble(stdout, (reg_t *) (uintptr_t) s->val);
+		disassemble(stdout, (code_t *) (uintptr_t) s->val);
 	else
 		printf("No symbol found\n");
 }
@@ -624,7 +1228,7 @@ void symtab_list(FILE *f)
 		fprintf(f, "    %s\n", s->name);
 }
 
-struct symbol *symtab_lookup(const char *name)
+static struct symbol *find_symbol(const char *name)
 {
 	for (struct symbol *s = globals; s; s = s->next)
 		if (0 == strcmp(name, s->name))
@@ -633,6 +1237,22 @@ struct symbol *symtab_lookup(const char *name)
 	return NULL;
 }
 
+struct symbol *symtab_lookup(const char *name)
+{
+	struct symbol *s;
+	uint64_t t;
+
+	if (!stats)
+		return find_symbol(name);
+
+	t = now_ns();
+	s = find_symbol(name);
+	compile_stats.lookup += now_ns() - t;
+	compile_stats.lookups++;
+
+	return s;
+}
+
 const char *symtab_name(reg_t addr)
 {
 	void *p = (void *) (uintptr_t) addr;
@@ -651,6 +1271,7 @@ struct symbol *symtab_new(const char *name, enum symtype type, reg_t val)
 	memcpy(namemem, name, namelen);
 
 	struct symbol *s = alloc(sizeof(struct symbol));
+	memset(s, 0, sizeof(*s));
 	s->name = namemem;
 	s->type = type;
 	s->val = val;;
@@ -669,38 +1290,92 @@ reg_t op_us(reg_t _)
 	return (reg_t) ((tv.tv_nsec / 1000) + 1000000 * tv.tv_sec);
 }
 
+#ifdef CONFIG_A64
+const struct backend *backend = &a64_backend;
+#else
+const struct backend *backend = &vm_backend;
+#endif
+
+static bool tiered;
+static reg_t tier_after = 1000;
+
+static void select_backend(const char *name)
+{
+	tiered = 0 == strcmp(name, "tiered");
+
+	if (0 == strcmp(name, "vm") || tiered)
+		backend = &vm_backend;
+#ifdef CONFIG_A64
+	else if (0 == strcmp(name, "native"))
+		backend = &a64_backend;
+#endif
+	else
+		die("Unknown backend: %s", name);
+}
+
 int main(int argc, char *argv[])
 {
+	bool interactive;
 	int c;
 
-	setvbuf(stdout, NULL, _IONBF, 0);
-	setvbuf(stderr, NULL, _IONBF, 0);
+	parser = pthread_self();
+	for (int i = 1; i < argc; i++) {
+		if (0 == strcmp(argv[i], "--stats"))
+			stats = true;
+		else if (starts_with(argv[i], "--backend="))
+			select_backend(argv[i] + strlen("--backend="));
+		else if (starts_with(argv[i], "--tier-after="))
+			tier_after = strtoul(argv[i] + strlen("--tier-after="),
+					     NULL, 0);
+		else
+			die("Unknown option: %s", argv[i]);
+	}
 
-	memp = alloc_memp();
-	set_sp(((reg_t) (uintptr_t) memp) + memsz);
+	// stdout is only block buffered when nobody is watching it
+	if (isatty(STDOUT_FILENO))
+		setvbuf(stdout, NULL, _IONBF, 0);
+	else
+		setvbuf(stdout, NULL, _IOFBF, 64 * 1024);
+	setvbuf(stderr, NULL, _IONBF, 0);
 
-	oob = memp;
-	memp += OOB_AREA;
+	alloc_core();
 	SET_OOB_CANARY();
 
 	register_ops();
+	if (tiered)
+		tier_enable(tier_after);
+
+	if (stats) {
+		compile_stats.start = now_ns();
+		compile_stats.code = codep;
+		atexit(print_stats);
+	}
+
+	// an interactive user expects each line to run as soon as it is typed
+	interactive = isatty(STDIN_FILENO);
 
 	while ((c = getchar()) != EOF) {
 		ungetc(c, stdin);
 
 		struct command cmd = parse_command();
-		if (cmd.sym) {
-			ooip = assemble_preamble(oob, NULL, 0);
-			ooip = assemble_word(ooip, &cmd);
-			ooip = assemble_postamble(ooip, NULL, 0);
-
-			CHECK_OOB_CANARY();
-			sync_caches(oob, ooip);
-			exec(oob);
-		} else {
+		if (!cmd.sym) {
+			run_batch();
 			fprintf(stderr, "Bad symbol: %s\n", cmd.opcode);
+			continue;
 		}
+
+		if (cmd.sym->type == WORDPTR)
+			run_batch();
+
+		if (!batch)
+			batch = assemble_preamble(oob, NULL, 0, NULL);
+		batch = emit_word(batch, &cmd);
+
+		if (cmd.sym->type == WORDPTR || cmd.sym->rewinds ||
+		    interactive || batch >= oob + OOB_AREA - OOB_SLACK)
+			run_batch();
 	}
+	run_batch();
 
 	return 0;
 }
@@ -0,0 +1,338 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+/*!
+ * \file thread.c
+ * \brief Threads
+ *
+ * `spawn` runs a word on a new OS thread and `join` waits for it to
+ * finish, returning whatever the word left in its first argument.
+ *
+ * Each thread has its own register set (the backends keep their registers
+ * in thread local storage). Its stacks, and the thread record that serves
+ * as its handle, are mapped below the 4GB boundary but outside the core
+ * memory so that a marker cannot free them while the thread is still
+ * around. A joined thread is kept on an idle list so that its memory can
+ * be reused by the next spawn.
+ *
+ * `pfor` runs a word over an index range using a persistent pool of
+ * worker threads (the calling thread joins in too). Each worker has its
+ * own deque of sub-ranges. Workers split the range they are working on in
+ * half, pushing the upper half onto their own deque, until it is no bigger
+ * than the grain. Idle workers steal the oldest (and therefore largest)
+ * range from the other deques.
+ *
+ * Only words can run on a spawned thread. The parser (and therefore
+ * anything that compiles code) must only be used by the main thread.
+ */
+
+/* pthread_attr_setstack() is not part of C99 */
+#define _DEFAULT_SOURCE
+
+#include "eigth.h"
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* native stack (also used for A64 code) and the VM's stack */
+#define THREAD_STACKSZ (64 * 1024)
+#define THREAD_VMSTACKSZ (16 * 1024)
+
+#define MAX_WORKERS 16
+#define DEQUE_SZ 64 // must be a power of two
+
+struct thread {
+	pthread_t tid;
+	void *stack;
+	reg_t sp;
+	reg_t word;
+	reg_t arg;
+	reg_t result;
+	bool joinable; // spawned and not yet joined
+	struct thread *next;
+	struct thread *all;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct thread *idle;
+static struct thread *threads; // every thread record, linked through all
+
+static struct thread *thread_new(void)
+{
+	struct thread *t;
+
+	pthread_mutex_lock(&lock);
+	t = idle;
+	if (t)
+		idle = t->next;
+	pthread_mutex_unlock(&lock);
+
+	// native stack, then the VM stack and finally the record itself
+	if (!t) {
+		size_t pagesz = sysconf(_SC_PAGESIZE);
+		size_t sz = THREAD_STACKSZ + THREAD_VMSTACKSZ +
+			    ((sizeof(*t) + pagesz - 1) & ~(pagesz - 1));
+		char *p = map_low(sz, PROT_READ | PROT_WRITE, -1);
+
+		if (!p)
+			die("Cannot allocate thread");
+		t = (struct thread *) (p + THREAD_STACKSZ + THREAD_VMSTACKSZ);
+		t->stack = p;
+		t->sp = (reg_t) (uintptr_t) t;
+
+		pthread_mutex_lock(&lock);
+		t->all = threads;
+		threads = t;
+		pthread_mutex_unlock(&lock);
+	}
+
+	return t;
+}
+
+static void thread_start(struct thread *t, void *(*fn)(void *))
+{
+	pthread_attr_t attr;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstack(&attr, t->stack, THREAD_STACKSZ);
+	if (pthread_create(&t->tid, &attr, fn, t))
+		die("Cannot create thread");
+	pthread_attr_destroy(&attr);
+}
+
+static void *thread_main(void *p)
+{
+	struct thread *t = p;
+
+	set_sp(t->sp);
+	set_arg(0, t->arg);
+	exec((code_t *) (uintptr_t) t->word);
+	t->result = get_regs().arg[0];
+
+	return NULL;
+}
+
+reg_t op_join(reg_t _, reg_t handle)
+{
+	struct thread *t;
+
+	// a thread can only be joined once (after that it is on the idle list)
+	pthread_mutex_lock(&lock);
+	for (t = threads; t; t = t->all)
+		if ((reg_t) (uintptr_t) t == handle)
+			break;
+	if (t && t->joinable)
+		t->joinable = false;
+	else
+		t = NULL;
+	pthread_mutex_unlock(&lock);
+	if (!t)
+		die("join: bad thread handle 0x%" PRIxREG, handle);
+
+	if (pthread_join(t->tid, NULL))
+		die("join: bad thread handle 0x%" PRIxREG, handle);
+
+	pthread_mutex_lock(&lock);
+	t->next = idle;
+	idle = t;
+	pthread_mutex_unlock(&lock);
+
+	return t->result;
+}
+
+reg_t op_spawn(reg_t _, reg_t word, reg_t arg)
+{
+	struct thread *t;
+
+	if (!in_code(word))
+		die("spawn: 0x%" PRIxREG " is not a word", word);
+
+	t = thread_new();
+	t->word = word;
+	t->arg = arg;
+	t->joinable = true;
+	thread_start(t, thread_main);
+
+	return (reg_t) (uintptr_t) t;
+}
+
+struct range {
+	reg_t lo;
+	reg_t hi;
+};
+
+/* the owner pushes and pops at the bottom, thieves steal from the top */
+struct worker {
+	pthread_mutex_t lock;
+	unsigned int top;
+	unsigned int bottom;
+	struct range deque[DEQUE_SZ];
+} __attribute__((aligned(CACHELINE)));
+
+static struct worker workers[MAX_WORKERS];
+static int nworkers;
+static __thread bool in_pfor;
+
+static pthread_mutex_t pfor_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pfor_wake = PTHREAD_COND_INITIALIZER;
+static unsigned int generation;
+
+static reg_t job_word;
+static reg_t job_grain;
+static reg_t job_remaining;
+
+static bool push(struct worker *w, struct range r)
+{
+	bool ok;
+
+	pthread_mutex_lock(&w->lock);
+	ok = w->bottom - w->top < DEQUE_SZ;
+	if (ok)
+		w->deque[w->bottom++ % DEQUE_SZ] = r;
+	pthread_mutex_unlock(&w->lock);
+
+	return ok;
+}
+
+static bool pop(struct worker *w, struct range *r)
+{
+	bool ok;
+
+	pthread_mutex_lock(&w->lock);
+	ok = w->bottom != w->top;
+	if (ok)
+		*r = w->deque[--w->bottom % DEQUE_SZ];
+	pthread_mutex_unlock(&w->lock);
+
+	return ok;
+}
+
+static bool steal(struct worker *w, struct range *r)
+{
+	bool ok;
+
+	pthread_mutex_lock(&w->lock);
+	ok = w->bottom != w->top;
+	if (ok)
+		*r = w->deque[w->top++ % DEQUE_SZ];
+	pthread_mutex_unlock(&w->lock);
+
+	return ok;
+}
+
+static void run_range(int id, struct range r)
+{
+	while (r.hi - r.lo > job_grain) {
+		struct range upper = { r.lo + (r.hi - r.lo) / 2, r.hi };
+
+		// if our deque is full then just do the work ourselves
+		if (!push(&workers[id], upper))
+			break;
+		r.hi = upper.lo;
+	}
+
+	set_arg(0, r.lo);
+	set_arg(1, r.hi);
+	exec((code_t *) (uintptr_t) job_word);
+
+	__atomic_sub_fetch(&job_remaining, r.hi - r.lo, __ATOMIC_RELEASE);
+}
+
+static void work(int id)
+{
+	struct range r;
+
+	while (__atomic_load_n(&job_remaining, __ATOMIC_ACQUIRE)) {
+		bool found = pop(&workers[id], &r);
+
+		for (int i = 1; !found && i < nworkers; i++)
+			found = steal(&workers[(id + i) % nworkers], &r);
+
+		if (found)
+			run_range(id, r);
+		else
+			sched_yield();
+	}
+}
+
+static void *worker_main(void *p)
+{
+	struct thread *t = p;
+	int id = t->arg;
+	unsigned int seen = 0;
+
+	set_sp(t->sp);
+	in_pfor = true;
+
+	for (;;) {
+		pthread_mutex_lock(&pfor_lock);
+		while (generation == seen)
+			pthread_cond_wait(&pfor_wake, &pfor_lock);
+		seen = generation;
+		pthread_mutex_unlock(&pfor_lock);
+
+		work(id);
+	}
+
+	return NULL;
+}
+
+static void start_workers(void)
+{
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+	nworkers = ncpu < 1 ? 1 : ncpu > MAX_WORKERS ? MAX_WORKERS : ncpu;
+
+	for (int i = 0; i < nworkers; i++)
+		pthread_mutex_init(&workers[i].lock, NULL);
+
+	// worker 0 is whichever thread called pfor (the others live for the
+	// rest of the run so their stacks must not be in the core memory,
+	// which thread_new() takes care of)
+	for (int i = 1; i < nworkers; i++) {
+		struct thread *t = thread_new();
+
+		t->arg = i;
+		thread_start(t, worker_main);
+	}
+}
+
+/*!
+ * \brief Call word(lo, hi) for sub-ranges covering [start, end)
+ *
+ * start and end are signed so ranges may include negative indices.
+ */
+reg_t op_pfor(reg_t word, reg_t start, reg_t end, reg_t grain)
+{
+	static pthread_mutex_t serialize = PTHREAD_MUTEX_INITIALIZER;
+
+	if (in_pfor)
+		die("pfor: cannot be nested");
+	if (!in_code(word))
+		die("pfor: 0x%" PRIxREG " is not a word", word);
+	if ((sreg_t) end <= (sreg_t) start)
+		return word;
+
+	// only one parallel loop can use the workers at a time
+	pthread_mutex_lock(&serialize);
+	if (!nworkers)
+		start_workers();
+
+	job_word = word;
+	job_grain = grain ? grain : 1;
+	__atomic_store_n(&job_remaining, end - start, __ATOMIC_RELEASE);
+	(void) push(&workers[0], (struct range) { start, end });
+
+	pthread_mutex_lock(&pfor_lock);
+	generation++;
+	pthread_cond_broadcast(&pfor_wake);
+	pthread_mutex_unlock(&pfor_lock);
+
+	in_pfor = true;
+	work(0);
+	in_pfor = false;
+
+	pthread_mutex_unlock(&serialize);
+
+	return word;
+}
@@ -0,0 +1,329 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+/*!
+ * \file tier.c
+ * \brief Tiered execution
+ *
+ * With --backend=tiered every word is first compiled for the portable VM,
+ * which is quick to generate and compact, and the commands (and control
+ * flow) that make up the word are retained. The VM counts calls to each
+ * word and once a word has been called often enough it is compiled again
+ * by the second tier backend. From then on the VM version of the word
+ * hands over to the promoted version as soon as it is entered.
+ *
+ * Words called by a promoted word are promoted with it so that promoted
+ * code only ever calls promoted code. A word that calls something that
+ * was not built by `define` (such as a variable) stays in the VM.
+ *
+ * The second tier is the native code generator. On hosts that do not have
+ * one the VM is used for both tiers, which is only useful for testing.
+ *
+ * Promotion generates code so it only happens on the thread that runs the
+ * parser and never while a word is being defined. Other threads count
+ * calls too (atomically) and pick up promoted words once they have been
+ * published. A word that cannot be replayed (because it nests deeper
+ * than replay() can track or there is no code space left) is marked as
+ * failed and stays in the VM.
+ */
+
+#include "eigth.h"
+#include <pthread.h>
+
+struct ir {
+	enum ir_kind kind;
+	struct command cmd;
+	struct compare cmp;
+	struct symbol sym; // copy of cmd.sym taken when the word was defined
+};
+
+struct tier {
+	reg_t calls;
+	code_t *entry;
+	code_t *promoted;
+	bool failed;
+	struct command cmd;
+	uint8_t clobbers;
+	struct ir *ir;
+	size_t len;
+	size_t cap;
+};
+
+const struct backend *tier_backend;
+static reg_t threshold;
+static pthread_t owner;
+
+static struct tier **tiers;
+static size_t ntiers;
+static size_t maxtiers;
+
+static void *grow(void *p, size_t *cap, size_t sz)
+{
+	*cap = *cap ? 2 * *cap : 64;
+	p = realloc(p, *cap * sz);
+	if (!p)
+		die("Cannot allocate tier records");
+
+	return p;
+}
+
+void tier_enable(reg_t after)
+{
+#ifdef CONFIG_A64
+	tier_backend = &a64_backend;
+#else
+	tier_backend = &vm_backend;
+#endif
+	threshold = after ? after : 1;
+	owner = pthread_self();
+}
+
+/*!
+ * \brief Start recording a word that is about to be defined
+ *
+ * Returns NULL if tiered execution is not enabled.
+ */
+struct tier *tier_new(code_t *entry, struct command *cmd, uint8_t clobbers)
+{
+	struct tier *t;
+
+	if (!threshold)
+		return NULL;
+
+	t = alloc(sizeof(*t));
+	memset(t, 0, sizeof(*t));
+	t->entry = entry;
+	t->cmd = *cmd;
+	t->clobbers = clobbers;
+
+	if (ntiers == maxtiers)
+		tiers = grow(tiers, &maxtiers, sizeof(*tiers));
+	tiers[ntiers++] = t;
+
+	return t;
+}
+
+void tier_record(struct tier *t, enum ir_kind kind, struct command *cmd,
+		 struct compare *cmp)
+{
+	struct ir *op;
+
+	if (!t)
+		return;
+
+	if (t->len == t->cap)
+		t->ir = grow(t->ir, &t->cap, sizeof(*t->ir));
+	op = &t->ir[t->len++];
+	memset(op, 0, sizeof(*op));
+	op->kind = kind;
+	if (cmd) {
+		op->cmd = *cmd;
+		if (cmd->sym)
+			op->sym = *cmd->sym;
+	}
+	if (cmp)
+		op->cmp = *cmp;
+}
+
+size_t tier_mark(struct tier *t)
+{
+	return t ? t->len : 0;
+}
+
+/*!
+ * \brief Discard everything recorded since mark (for `if 0`, etc)
+ */
+void tier_rewind(struct tier *t, size_t mark)
+{
+	if (t)
+		t->len = mark;
+}
+
+/*!
+ * \brief Forget about code at or above code (which is being released)
+ *
+ * Words defined before code may still have been promoted after it, in
+ * which case they have to go back to running in the VM.
+ */
+void tier_forget(code_t *code)
+{
+	size_t n = 0;
+
+	for (size_t i = 0; i < ntiers; i++) {
+		struct tier *t = tiers[i];
+
+		if (t->entry >= code) {
+			free(t->ir);
+			continue;
+		}
+		if (t->promoted >= code) {
+			__atomic_store_n(&t->promoted, NULL, __ATOMIC_RELEASE);
+			__atomic_store_n(&t->calls, 0, __ATOMIC_RELAXED);
+		}
+		tiers[n++] = t;
+	}
+
+	ntiers = n;
+}
+
+static struct tier *find_tier(reg_t entry)
+{
+	for (size_t i = ntiers; i > 0; i--)
+		if ((reg_t) (uintptr_t) tiers[i - 1]->entry == entry)
+			return tiers[i - 1];
+
+	return NULL;
+}
+
+/*!
+ * \brief Assemble the retained commands of t at ip with backend b
+ *
+ * Returns the end of the code, or NULL if the word cannot be replayed.
+ */
+static code_t *replay(const struct backend *b, struct tier *t, code_t *ip)
+{
+	code_t *fixups[64];
+	int depth = 0;
+	struct case_block cases[16], *c;
+	int ncases = 0;
+	code_t *entry = ip;
+
+	if (!code_room(ip, CODE_SLACK))
+		goto fail;
+	ip = b->assemble_preamble(ip, &t->cmd, t->clobbers, NULL);
+
+	for (size_t i = 0; i < t->len; i++) {
+		struct ir *op = &t->ir[i];
+		struct command cmd = op->cmd;
+		struct symbol sym = op->sym;
+
+		if (!code_room(ip, CODE_SLACK))
+			goto fail;
+
+		switch (op->kind) {
+		case IR_WORD:
+			if (sym.type == EXECPTR)
+				sym.val = (reg_t) (uintptr_t)
+						  find_tier(sym.val)->promoted;
+			cmd.sym = &sym;
+			ip = b->assemble_word(ip, &cmd);
+			break;
+		case IR_RECURSE:
+			sym.type = EXECPTR;
+			sym.val = (reg_t) (uintptr_t) entry;
+			cmd.sym = &sym;
+			ip = b->assemble_word(ip, &cmd);
+			break;
+		case IR_IF:
+			if (depth == lengthof(fixups))
+				goto fail;
+			ip = b->assemble_if(ip, &op->cmp, &fixups[depth++]);
+			break;
+		case IR_ELSE:
+			ip = b->assemble_else(ip, &fixups[depth - 1]);
+			break;
+		case IR_ENDIF:
+			b->fixup_if(ip, fixups[--depth]);
+			break;
+		case IR_WHILE:
+			if (depth == lengthof(fixups))
+				goto fail;
+			ip = b->assemble_while(ip, &op->cmp, &fixups[depth++]);
+			break;
+		case IR_ENDWHILE:
+			ip = b->assemble_endwhile(ip, fixups[--depth]);
+			break;
+		case IR_CASE:
+			if (ncases == lengthof(cases))
+				goto fail;
+			ip = case_begin(b, ip, &cases[ncases++],
+					cmd.operand[0].value);
+			break;
+		case IR_OF:
+			c = &cases[ncases - 1];
+			ip = case_section(b, ip, c);
+			for (int j = 0; j < lengthof(cmd.operand) &&
+					cmd.operand[j].type != INVALID;
+			     j++)
+				case_of(c, cmd.operand[j].value, ip);
+			break;
+		case IR_DEFAULT:
+			c = &cases[ncases - 1];
+			ip = case_section(b, ip, c);
+			case_default(c, ip);
+			break;
+		case IR_ENDCASE:
+			c = &cases[ncases - 1];
+			if (!code_room(ip, CODE_SLACK +
+						   CASE_SLACK * c->nlabels))
+				goto fail;
+			ip = case_end(b, ip, c);
+			ncases--;
+			break;
+		}
+	}
+
+	if (!code_room(ip, CODE_SLACK))
+		goto fail;
+	return b->assemble_postamble(ip, &t->cmd, t->clobbers, NULL);
+
+fail:
+	while (ncases)
+		case_discard(&cases[--ncases]);
+	return NULL;
+}
+
+static code_t *promote(struct tier *t)
+{
+	code_t *p, *end;
+
+	if (t->promoted || t->failed)
+		return t->promoted;
+
+	// callees first (they were all defined before us so there can be no
+	// cycles other than recursion, which is handled by replay)
+	for (size_t i = 0; i < t->len; i++) {
+		struct tier *callee;
+
+		if (t->ir[i].kind != IR_WORD || t->ir[i].sym.type != EXECPTR)
+			continue;
+
+		callee = find_tier(t->ir[i].sym.val);
+		if (!callee || !promote(callee)) {
+			__atomic_store_n(&t->failed, true, __ATOMIC_RELAXED);
+			return NULL;
+		}
+	}
+
+	p = code_begin();
+	if (!p)
+		return NULL;
+	end = replay(tier_backend, t, p);
+	if (!end) {
+		__atomic_store_n(&t->failed, true, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	code_end(p, end);
+	__atomic_store_n(&t->promoted, p, __ATOMIC_RELEASE);
+
+	return p;
+}
+
+/*!
+ * \brief Count a call to a VM word
+ *
+ * Returns the entry point of the promoted version of the word, if there
+ * is one.
+ */
+code_t *tier_count(struct tier *t)
+{
+	code_t *p = __atomic_load_n(&t->promoted, __ATOMIC_ACQUIRE);
+
+	if (p || __atomic_load_n(&t->failed, __ATOMIC_RELAXED) ||
+	    __atomic_add_fetch(&t->calls, 1, __ATOMIC_RELAXED) < threshold)
+		return p;
+
+	if (!pthread_equal(pthread_self(), owner))
+		return NULL;
+
+	return promote(t);
+}
@@ -0,0 +1,162 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+
+/*!
+ * \file vec.c
+ * \brief Array kernels
+ *
+ * These words operate on whole arrays of registers at once. They are
+ * written using GCC's generic vector extensions so the same source
+ * compiles to SSE2 (or AVX2, selected at load time) on x86 and to NEON on
+ * AArch64. Anything left over after the last full vector is handled by a
+ * scalar tail.
+ */
+
+#include "eigth.h"
+
+#define VLEN 8
+
+typedef reg_t vec_t __attribute__((vector_size(VLEN * sizeof(reg_t))));
+typedef sreg_t svec_t __attribute__((vector_size(VLEN * sizeof(reg_t))));
+
+#if defined(__x86_64__)
+#define VECTORIZE __attribute__((target_clones("avx2", "default")))
+#else
+#define VECTORIZE
+#endif
+
+static inline reg_t *ptr(reg_t p)
+{
+	return (reg_t *) (uintptr_t) p;
+}
+
+/*
+ * Unaligned vector access. These are macros rather than functions because
+ * passing wide vectors by value would change the ABI of the helpers
+ * depending on which ISA extensions are enabled.
+ */
+typedef vec_t uvec_t __attribute__((aligned(sizeof(reg_t)), may_alias));
+#define vload(p) (*(const uvec_t *) (p))
+#define vstore(p, v) (*(uvec_t *) (p) = (v))
+
+#define ELEMENTWISE(name, op)                                              \
+	VECTORIZE reg_t op_##name(reg_t d, reg_t a, reg_t b, reg_t n)      \
+	{                                                                  \
+		reg_t *dst = ptr(d), *x = ptr(a), *y = ptr(b);             \
+		reg_t i = 0;                                               \
+                                                                           \
+		for (; i + VLEN <= n; i += VLEN)                           \
+			vstore(dst + i, vload(x + i) op vload(y + i));     \
+		for (; i < n; i++)                                         \
+			dst[i] = x[i] op y[i];                             \
+                                                                           \
+		return d;                                                  \
+	}                                                                  \
+                                                                           \
+	VECTORIZE reg_t op_##name##s(reg_t d, reg_t a, reg_t s, reg_t n)   \
+	{                                                                  \
+		reg_t *dst = ptr(d), *x = ptr(a);                          \
+		vec_t vs = (vec_t) {} + s;                                 \
+		reg_t i = 0;                                               \
+                                                                           \
+		for (; i + VLEN <= n; i += VLEN)                           \
+			vstore(dst + i, vload(x + i) op vs);               \
+		for (; i < n; i++)                                         \
+			dst[i] = x[i] op s;                                \
+                                                                           \
+		return d;                                                  \
+	}
+
+ELEMENTWISE(vadd, +)
+ELEMENTWISE(vand, &)
+ELEMENTWISE(vmul, *)
+ELEMENTWISE(vor, |)
+ELEMENTWISE(vsub, -)
+ELEMENTWISE(vxor, ^)
+
+/*
+ * Select the lanes of a where mask is set and the lanes of b where it is
+ * not (the vector extensions do not support ?: in C).
+ */
+#define vselect(mask, a, b) (((a) & (mask)) | ((b) & ~(mask)))
+
+#define REDUCE(name, cmp)                                                  \
+	VECTORIZE reg_t op_##name(reg_t _, reg_t a, reg_t n)               \
+	{                                                                  \
+		sreg_t *x = (sreg_t *) ptr(a);                             \
+		sreg_t res;                                                \
+		reg_t i = 0;                                               \
+                                                                           \
+		if (!n)                                                    \
+			return 0;                                          \
+                                                                           \
+		res = x[0];                                                \
+		if (n >= VLEN) {                                           \
+			svec_t acc = (svec_t) vload((reg_t *) x);          \
+			for (i = VLEN; i + VLEN <= n; i += VLEN) {         \
+				svec_t v = (svec_t) vload((reg_t *) x + i); \
+				acc = vselect(v cmp acc, v, acc);          \
+			}                                                  \
+			res = acc[0];                                      \
+			for (int j = 1; j < VLEN; j++)                     \
+				if (acc[j] cmp res)                        \
+					res = acc[j];                      \
+		}                                                          \
+		for (; i < n; i++)                                         \
+			if (x[i] cmp res)                                  \
+				res = x[i];                                \
+                                                                           \
+		return res;                                                \
+	}
+
+REDUCE(vmax, >)
+REDUCE(vmin, <)
+
+VECTORIZE reg_t op_vsum(reg_t _, reg_t a, reg_t n)
+{
+	reg_t *x = ptr(a);
+	vec_t acc = {};
+	reg_t res = 0;
+	reg_t i = 0;
+
+	for (; i + VLEN <= n; i += VLEN)
+		acc += vload(x + i);
+	for (int j = 0; j < VLEN; j++)
+		res += acc[j];
+	for (; i < n; i++)
+		res += x[i];
+
+	return res;
+}
+
+/*!
+ * \brief Inclusive prefix sum (dst[i] = a[0] + ... + a[i])
+ *
+ * Each vector is scanned in log2(VLEN) shift-and-add steps and the
+ * running total from the previous vector is then added to every lane.
+ */
+VECTORIZE reg_t op_vscan(reg_t d, reg_t a, reg_t n)
+{
+	reg_t *dst = ptr(d), *x = ptr(a);
+	const vec_t zero = {};
+	vec_t carry = {};
+	reg_t i = 0;
+
+	for (; i + VLEN <= n; i += VLEN) {
+		vec_t v = vload(x + i);
+		v += __builtin_shuffle(v, zero,
+				       (vec_t) { 8, 0, 1, 2, 3, 4, 5, 6 });
+		v += __builtin_shuffle(v, zero,
+				       (vec_t) { 8, 8, 0, 1, 2, 3, 4, 5 });
+		v += __builtin_shuffle(v, zero,
+				       (vec_t) { 8, 8, 8, 8, 0, 1, 2, 3 });
+		v += carry;
+		vstore(dst + i, v);
+		carry = __builtin_shuffle(v, (vec_t) { 7, 7, 7, 7, 7, 7, 7, 7 });
+	}
+
+	reg_t sum = carry[0];
+	for (; i < n; i++)
+		dst[i] = sum += x[i];
+
+	return d;
+}
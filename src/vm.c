@@ -66,6 +66,8 @@ enum opcode {
 	BGEU,
 #define ASM_BGEU(a, b, offset) ASM3(BGEU, a, b, offset)
 #define ASM_BLEU(a, b, offset) ASM3(BGEU, b, a, offset)
+	BSWAP,
+#define ASM_BSWAP(dst, src) ASM2(BSWAP, dst, src)
 	CALL0,
 #define ASM_CALL0() CALL0
 	CALL1,
@@ -76,6 +78,10 @@ enum opcode {
 #define ASM_CALL3() CALL3
 	CALL4,
 #define ASM_CALL4() CALL4
+	CLZ,
+#define ASM_CLZ(dst, src) ASM2(CLZ, dst, src)
+	CTZ,
+#define ASM_CTZ(dst, src) ASM2(CTZ, dst, src)
 	EXEC0,
 #define ASM_EXEC0() EXEC0
 	EXEC1,
@@ -86,32 +92,81 @@ enum opcode {
 #define ASM_EXEC3() EXEC3
 	EXEC4,
 #define ASM_EXEC4() EXEC4
+	JTAB,
+#define ASM_JTAB(reg) ASM1(JTAB, reg)
+	LDB,
+#define ASM_LDB(dst, p, idx) ASM3(LDB, dst, p, idx)
+	LDBP,
+#define ASM_LDBP(dst, p) ASM2(LDBP, dst, p)
+	LDW,
+#define ASM_LDW(dst, p, idx) ASM3(LDW, dst, p, idx)
+	LDWP,
+#define ASM_LDWP(dst, p) ASM2(LDWP, dst, p)
 	MOV,
 #define ASM_MOV(dst, src) ASM2(MOV, dst, src)
 	MOV16,
 #define ASM_MOV16(dst, val) ASM23(MOV16, dst, val)
 	MOVHI,
 #define ASM_MOVHI(dst, val) ASM23(MOVHI, dst, val)
-	POP,
-#define ASM_POP(dst) ASM1(POP, dst)
-	PUSH,
-#define ASM_PUSH(src) ASM1(PUSH, src)
+	MOVLIT,
+#define ASM_MOVLIT(dst) ASM1(MOVLIT, dst)
+	POPCNT,
+#define ASM_POPCNT(dst, src) ASM2(POPCNT, dst, src)
+	POPM,
+#define ASM_POPM(mask) ASM3(POPM, 0, 0, mask)
+	PROFIN,
+#define ASM_PROFIN() PROFIN
+	PROFOUT,
+#define ASM_PROFOUT() PROFOUT
+	PUSHM,
+#define ASM_PUSHM(mask) ASM3(PUSHM, 0, 0, mask)
 	RET,
 #define ASM_RET() RET
+	ROL,
+#define ASM_ROL(dst, src, n) ASM3(ROL, dst, src, n)
+	ROR,
+#define ASM_ROR(dst, src, n) ASM3(ROR, dst, src, n)
+	STB,
+#define ASM_STB(src, p, idx) ASM3(STB, src, p, idx)
+	STBP,
+#define ASM_STBP(src, p) ASM2(STBP, src, p)
+	STW,
+#define ASM_STW(src, p, idx) ASM3(STW, src, p, idx)
+	STWP,
+#define ASM_STWP(src, p) ASM2(STWP, src, p)
+	TIER,
+#define ASM_TIER() TIER
 };
 
-static struct regset regs;
+static __thread struct regset regs;
 
-static reg_t *assemble_prologue(reg_t *ip, int narg, struct operand *op)
+/*
+ * Values that do not fit in 32-bits (which can only happen when registers
+ * are 64-bit) are stored as a literal immediately after the opcode.
+ */
+static code_t *assemble_mov_imm(code_t *ip, int reg, reg_t value)
+{
+	if (value >> 16 >> 16) {
+		*ip++ = ASM_MOVLIT(reg);
+		memcpy(ip, &value, sizeof(value));
+		return ip + sizeof(value) / sizeof(*ip);
+	}
+
+	*ip++ = ASM_MOV16(reg, value & 0xffff);
+	if (value >> 16)
+		*ip++ = ASM_MOVHI(reg, value >> 16);
+
+	return ip;
+}
+
+static code_t *assemble_prologue(code_t *ip, int narg, struct operand *op)
 {
 	switch (op->type) {
 		case REGISTER:
 			*ip++ = ASM_MOV(ARG(narg), op->value);
 			break;
 		case IMMEDIATE:
-			*ip++ = ASM_MOV16(ARG(narg), op->value & 0xffff);
-			if (op->value >> 16)
-				*ip++ = ASM_MOVHI(ARG(narg), op->value >> 16);
+			ip = assemble_mov_imm(ip, ARG(narg), op->value);
 			break;
 		case ARGUMENT:
 		case INVALID:
@@ -122,7 +177,7 @@ static reg_t *assemble_prologue(reg_t *ip, int narg, struct operand *op)
 	return ip;
 }
 
-static reg_t *assemble_epilogue(reg_t *ip, struct operand *op)
+static code_t *assemble_epilogue(code_t *ip, struct operand *op)
 {
 	if (op->type == REGISTER)
 		*ip++ = ASM_MOV(op->value, ARG(0));
@@ -130,23 +185,151 @@ static reg_t *assemble_epilogue(reg_t *ip, struct operand *op)
 	return ip;
 }
 
-reg_t *assemble_word(reg_t *ip, struct command *word)
+/*
+ * Get the register holding an operand, loading immediates into the
+ * argument register for that operand if needed.
+ */
+static reg_t assemble_operand(code_t **ip, int narg, struct operand *op)
+{
+	if (op->type == REGISTER)
+		return op->value;
+
+	*ip = assemble_prologue(*ip, narg, op);
+	return ARG(narg);
+}
+
+static int count_operands(struct command *word)
 {
 	int narg;
 
+	for (narg = 0; narg < 4; narg++)
+		if (word->operand[narg].type == INVALID)
+			break;
+
+	return narg;
+}
+
+/*
+ * Expand intrinsics inline. Unlike calls these operate directly on the
+ * registers named in the operands. Returns NULL if word cannot be
+ * expanded (in which case it must be called instead).
+ */
+static code_t *assemble_intrinsic(code_t *ip, struct command *word)
+{
+	struct operand *op = word->operand;
+	int narg = count_operands(word);
+	reg_t dst, a, b;
+
+	switch (word->sym->intrinsic) {
+	case I_BSWAP:
+	case I_CLZ:
+	case I_CTZ:
+	case I_POPCNT:
+		if (narg != 2)
+			return NULL;
+		break;
+	case I_LDB_POST:
+	case I_LDW_POST:
+	case I_STB_POST:
+	case I_STW_POST:
+		// we can only write back a pointer held in a register
+		if (narg != 2 || op[1].type != REGISTER)
+			return NULL;
+		break;
+	case I_LDB:
+	case I_LDW:
+	case I_ROL:
+	case I_ROR:
+	case I_STB:
+	case I_STW:
+		if (narg != 3)
+			return NULL;
+		break;
+	default:
+		return NULL;
+	}
+
+	// an immediate destination discards the result
+	dst = op[0].type == REGISTER ? op[0].value : ARG(0);
+	a = assemble_operand(&ip, 1, &op[1]);
+
+	switch (word->sym->intrinsic) {
+	case I_BSWAP:
+		*ip++ = ASM_BSWAP(dst, a);
+		break;
+	case I_CLZ:
+		*ip++ = ASM_CLZ(dst, a);
+		break;
+	case I_CTZ:
+		*ip++ = ASM_CTZ(dst, a);
+		break;
+	case I_LDB:
+		b = assemble_operand(&ip, 2, &op[2]);
+		*ip++ = ASM_LDB(dst, a, b);
+		break;
+	case I_LDB_POST:
+		*ip++ = ASM_LDBP(dst, a);
+		break;
+	case I_LDW:
+		b = assemble_operand(&ip, 2, &op[2]);
+		*ip++ = ASM_LDW(dst, a, b);
+		break;
+	case I_LDW_POST:
+		*ip++ = ASM_LDWP(dst, a);
+		break;
+	case I_POPCNT:
+		*ip++ = ASM_POPCNT(dst, a);
+		break;
+	case I_ROL:
+		b = assemble_operand(&ip, 2, &op[2]);
+		*ip++ = ASM_ROL(dst, a, b);
+		break;
+	case I_ROR:
+		b = assemble_operand(&ip, 2, &op[2]);
+		*ip++ = ASM_ROR(dst, a, b);
+		break;
+	case I_STB:
+		dst = assemble_operand(&ip, 0, &op[0]);
+		b = assemble_operand(&ip, 2, &op[2]);
+		*ip++ = ASM_STB(dst, a, b);
+		break;
+	case I_STB_POST:
+		dst = assemble_operand(&ip, 0, &op[0]);
+		*ip++ = ASM_STBP(dst, a);
+		break;
+	case I_STW:
+		dst = assemble_operand(&ip, 0, &op[0]);
+		b = assemble_operand(&ip, 2, &op[2]);
+		*ip++ = ASM_STW(dst, a, b);
+		break;
+	case I_STW_POST:
+		dst = assemble_operand(&ip, 0, &op[0]);
+		*ip++ = ASM_STWP(dst, a);
+		break;
+	default:
+		assert(false);
+	}
+
+	return ip;
+}
+
+static code_t *vm_assemble_word(code_t *ip, struct command *word)
+{
+	int narg;
+	code_t *p;
+
 	if (word->sym->type == CONSTANT) {
 		reg_t reg = word->operand[0].value;
 		reg_t value = word->sym->val;
 
-		*ip++ = ASM_MOV16(reg, value & 0xffff);
-		if (value >> 16)
-			*ip++ = ASM_MOVHI(reg, value >> 16);
-
-		return ip;
+		return assemble_mov_imm(ip, reg, value);
 	}
 	assert(word->sym->type == FUNCPTR || word->sym->type == WORDPTR ||
 	       word->sym->type == EXECPTR);
 
+	if (word->sym->intrinsic && (p = assemble_intrinsic(ip, word)))
+		return p;
+
 	for (narg=0; narg<4; narg++) {
 		if (word->operand[narg].type == INVALID)
 			break;
@@ -181,14 +364,20 @@ reg_t *assemble_word(reg_t *ip, struct command *word)
 	return ip;
 }
 
-reg_t *assemble_ret(reg_t *ip)
+static code_t *vm_assemble_ret(code_t *ip)
 {
 	*ip++ = ASM_RET();
 	return ip;
 }
 
-reg_t *assemble_preamble(reg_t *ip, struct command *cmd, uint8_t clobbers)
+static code_t *vm_assemble_preamble(code_t *ip, struct command *cmd,
+				    uint8_t clobbers, struct profile *prof)
 {
+	if (prof) {
+		*ip++ = ASM_PROFIN();
+		*ip++ = (code_t) (uintptr_t) prof;
+	}
+
 	// add the arguments to the clobber list
 	for (int i = 0; cmd && i < lengthof(cmd->operand) &&
 			cmd->operand[i].type == REGISTER;
@@ -196,9 +385,8 @@ reg_t *assemble_preamble(reg_t *ip, struct command *cmd, uint8_t clobbers)
 		clobbers |= 1 << cmd->operand[i].value;
 
 	// save the state we are about to clobber
-	for (int i = 0; i < 8; i++)
-		if (clobbers & (1 << i))
-			*ip++ = ASM_PUSH(i);
+	if (clobbers)
+		*ip++ = ASM_PUSHM(clobbers);
 
 	// move the arguments into the right registers
 	for (int i = 0; cmd && i < lengthof(cmd->operand) &&
@@ -209,7 +397,8 @@ reg_t *assemble_preamble(reg_t *ip, struct command *cmd, uint8_t clobbers)
 	return ip;
 }
 
-reg_t *assemble_postamble(reg_t *ip, struct command *cmd, uint8_t clobbers)
+static code_t *vm_assemble_postamble(code_t *ip, struct command *cmd,
+				     uint8_t clobbers, struct profile *prof)
 {
 	// add the arguments to the clobber list
 	for (int i = 0; cmd && i < lengthof(cmd->operand) &&
@@ -222,14 +411,18 @@ reg_t *assemble_postamble(reg_t *ip, struct command *cmd, uint8_t clobbers)
 		*ip++ = ASM_MOV(ARG(0), cmd->operand[0].value);
 
 	// restore the saved registers
-	for (int i = 7; i >= 0; i--)
-		if (clobbers & (1 << i))
-			*ip++ = ASM_POP(i);
+	if (clobbers)
+		*ip++ = ASM_POPM(clobbers);
+
+	if (prof) {
+		*ip++ = ASM_PROFOUT();
+		*ip++ = (code_t) (uintptr_t) prof;
+	}
 
-	return assemble_ret(ip);
+	return vm_assemble_ret(ip);
 }
 
-reg_t *assemble_if(reg_t *ip, struct compare *cmp, reg_t **fixup)
+static code_t *vm_assemble_if(code_t *ip, struct compare *cmp, code_t **fixup)
 {
 	*fixup = ip;
 	switch (cmp->rel) {
@@ -271,32 +464,97 @@ reg_t *assemble_if(reg_t *ip, struct compare *cmp, reg_t **fixup)
 	return ip;
 }
 
-reg_t *assemble_else(reg_t *ip, reg_t **fixup)
+static void vm_fixup_if(code_t *ip, code_t *fixup)
+{
+	int offset = ip - fixup - 1;
+	*fixup |= (offset & F3MASK) << F3SHIFT;
+}
+
+static code_t *vm_assemble_else(code_t *ip, code_t **fixup)
 {
-	reg_t *oldip = ip;
+	code_t *oldip = ip;
 	*ip++ = ASM_B(0);
-	fixup_if(ip, *fixup);
+	vm_fixup_if(ip, *fixup);
 	*fixup = oldip;
 
 	return ip;
 
 }
 
-void fixup_if(reg_t *ip, reg_t *fixup)
+static code_t *vm_assemble_while(code_t *ip, struct compare *cmp,
+				 code_t **fixup)
 {
-	int offset = ip - fixup - 1;
-	*fixup |= offset << F3SHIFT;
+	return vm_assemble_if(ip, cmp, fixup);
 }
 
-reg_t *assemble_while(reg_t *ip, struct compare *cmp, reg_t **fixup)
+static code_t *vm_assemble_endwhile(code_t *ip, code_t *fixup)
 {
-	return assemble_if(ip, cmp, fixup);
+	*ip = ASM_B(fixup - ip - 1);
+	vm_fixup_if(++ip, fixup);
+	return ip;
 }
 
-reg_t *assemble_endwhile(reg_t *ip, reg_t *fixup)
+static code_t *vm_assemble_jump(code_t *ip, code_t **fixup)
 {
-	*ip = ASM_B(fixup - ip - 1);
-	fixup_if(++ip, fixup);
+	*fixup = ip;
+	*ip++ = ASM_B(0);
+	return ip;
+}
+
+/*
+ * Branch if reg compares true with value. The arguments are dead between
+ * commands so arg0 is free to hold the value.
+ */
+static code_t *vm_assemble_branch_imm(code_t *ip, int reg, enum relop rel,
+				      reg_t value, code_t **fixup)
+{
+	ip = assemble_mov_imm(ip, ARG(0), value);
+
+	*fixup = ip;
+	switch (rel) {
+	case EQ:
+		*ip++ = ASM_BEQ(reg, ARG(0), 0);
+		break;
+	case NE:
+		*ip++ = ASM_BNE(reg, ARG(0), 0);
+		break;
+	case LT:
+		*ip++ = ASM_BLT(reg, ARG(0), 0);
+		break;
+	case GT:
+		*ip++ = ASM_BGT(reg, ARG(0), 0);
+		break;
+	case LTEQ:
+		*ip++ = ASM_BLE(reg, ARG(0), 0);
+		break;
+	case GTEQ:
+		*ip++ = ASM_BGE(reg, ARG(0), 0);
+		break;
+	case LTU:
+		*ip++ = ASM_BLTU(reg, ARG(0), 0);
+		break;
+	case GTU:
+		*ip++ = ASM_BGTU(reg, ARG(0), 0);
+		break;
+	case LTEU:
+		*ip++ = ASM_BLEU(reg, ARG(0), 0);
+		break;
+	case GTEU:
+		*ip++ = ASM_BGEU(reg, ARG(0), 0);
+		break;
+	case CMPNZ:
+		*ip++ = ASM_BNZ(reg, 0);
+		break;
+	}
+
+	return ip;
+}
+
+static code_t *vm_assemble_jump_table(code_t *ip, int reg,
+				      struct jump_table *t)
+{
+	*ip++ = ASM_JTAB(reg);
+	*ip++ = (code_t) (uintptr_t) t;
 	return ip;
 }
 
@@ -335,12 +593,14 @@ static void trace_symbol(FILE *f, const char *op, reg_t arg)
 		fprintf(f, "\t%s\t%p\n", op, (void *) (uintptr_t) arg);
 }
 
-static reg_t *trace(FILE *f, reg_t *ip)
+static code_t *trace(FILE *f, code_t *ip)
 {
-	reg_t a, b;
+	int a, b;
+	reg_t lit;
 	int16_t off;
+	const char *sep;
 
-	reg_t op = *ip++;
+	code_t op = *ip++;
 	switch (op & OPMASK) {
 	case BEQ:
 		a = F1DECODE(op);
@@ -380,6 +640,17 @@ static reg_t *trace(FILE *f, reg_t *ip)
 						"bgeu",
 			regname(a), regname(b), off);
 		break;
+	case BSWAP:
+	case CLZ:
+	case CTZ:
+	case POPCNT:
+		fprintf(f, "\t%s\t%s, %s\n",
+			(op & OPMASK) == BSWAP ? "bswap" :
+			(op & OPMASK) == CLZ   ? "clz" :
+			(op & OPMASK) == CTZ   ? "ctz" :
+						 "popcnt",
+			regname(F1DECODE(op)), regname(F2DECODE(op)));
+		break;
 	case CALL0:
 		trace_symbol(f, "call0", *ip++);
 		break;
@@ -410,6 +681,31 @@ static reg_t *trace(FILE *f, reg_t *ip)
 	case EXEC4:
 		trace_symbol(f, "exec4", *ip++);
 		break;
+	case JTAB:
+		fprintf(f, "\tjtab\t%s, %p\n", regname(F1DECODE(op)),
+			(void *) (uintptr_t) *ip++);
+		break;
+	case LDB:
+	case LDW:
+	case STB:
+	case STW:
+		fprintf(f, "\t%s\t%s, %s, %s\n",
+			(op & OPMASK) == LDB ? "ldb" :
+			(op & OPMASK) == LDW ? "ldw" :
+			(op & OPMASK) == STB ? "stb" : "stw",
+			regname(F1DECODE(op)), regname(F2DECODE(op)),
+			regname(F3DECODE(op)));
+		break;
+	case LDBP:
+	case LDWP:
+	case STBP:
+	case STWP:
+		fprintf(f, "\t%s\t%s, %s\n",
+			(op & OPMASK) == LDBP ? "ldb+" :
+			(op & OPMASK) == LDWP ? "ldw+" :
+			(op & OPMASK) == STBP ? "stb+" : "stw+",
+			regname(F1DECODE(op)), regname(F2DECODE(op)));
+		break;
 	case MOV:
 		fprintf(f, "\tmov\t%s, %s\n", regname(F1DECODE(op)),
 			regname(F2DECODE(op)));
@@ -422,35 +718,66 @@ static reg_t *trace(FILE *f, reg_t *ip)
 		fprintf(f, "\tmovhi\t%s, %d\n", regname(F1DECODE(op)),
 			F23DECODE(op));
 		break;
-	case POP:
-		fprintf(f, "\tpop\t%s\n", regname(F1DECODE(op)));
+	case MOVLIT:
+		memcpy(&lit, ip, sizeof(lit));
+		ip += sizeof(lit) / sizeof(*ip);
+		fprintf(f, "\tmovlit\t%s, 0x%" PRIxREG "\n", regname(F1DECODE(op)),
+			lit);
+		break;
+	case POPM:
+	case PUSHM:
+		fprintf(f, "\t%s\t", (op & OPMASK) == POPM ? "popm" : "pushm");
+		sep = "{";
+		for (int i = 0; i < 8; i++) {
+			if (F3DECODE(op) & (1 << i)) {
+				fprintf(f, "%s%s", sep, regname(i));
+				sep = ", ";
+			}
+		}
+		fprintf(f, "}\n");
+		break;
+	case PROFIN:
+		fprintf(f, "\tprofin\t%p\n", (void *) (uintptr_t) *ip++);
 		break;
-	case PUSH:
-		fprintf(f, "\tpush\t%s\n", regname(F1DECODE(op)));
+	case PROFOUT:
+		fprintf(f, "\tprofout\t%p\n", (void *) (uintptr_t) *ip++);
 		break;
 	case RET:
 		fprintf(f, "\tret\n");
 		return NULL;
+	case ROL:
+	case ROR:
+		fprintf(f, "\t%s\t%s, %s, %s\n",
+			(op & OPMASK) == ROL ? "rol" : "ror",
+			regname(F1DECODE(op)), regname(F2DECODE(op)),
+			regname(F3DECODE(op)));
+		break;
+	case TIER:
+		fprintf(f, "\ttier\t%p\n", (void *) (uintptr_t) *ip++);
+		break;
 	}
 
 	return ip;
 }
 
-void disassemble(FILE *f, reg_t *ip)
+static void vm_disassemble(FILE *f, code_t *ip)
 {
 	while (ip)
 		ip = trace(f, ip);
 }
 
-void exec(reg_t *ip)
+static void vm_exec(code_t *ip)
 {
-	reg_t fn;
-	reg_t *sp;
+	reg_t fn, idx;
+	reg_t *sp, *wp;
+	uint8_t *p;
+	code_t *target;
+	struct jump_table *jt;
 
 	while (true) {
 		//fprintf(stderr, "%p: ", ip);
 		//(void) trace(stderr, ip);
-		reg_t op = *ip++;
+		code_t op = *ip++;
 		switch (op & OPMASK) {
 		case BEQ:
 			if (regs.r[F1DECODE(op)] == regs.r[F2DECODE(op)])
@@ -478,6 +805,9 @@ void exec(reg_t *ip)
 			if (regs.r[F1DECODE(op)] >= regs.r[F2DECODE(op)])
 				ip += (int16_t) F3DECODE(op);
 			break;
+		case BSWAP:
+			regs.r[F1DECODE(op)] = reg_bswap(regs.r[F2DECODE(op)]);
+			break;
 		case CALL0:
 			fn = *ip++;
 			regs.arg[0] = ((reg_t(*)(void))(uintptr_t)fn)();
@@ -504,12 +834,41 @@ void exec(reg_t *ip)
 				uintptr_t)fn)(regs.arg[0], regs.arg[1],
 					      regs.arg[2], regs.arg[3]);
 			break;
+		case CLZ:
+			regs.r[F1DECODE(op)] = reg_clz(regs.r[F2DECODE(op)]);
+			break;
+		case CTZ:
+			regs.r[F1DECODE(op)] = reg_ctz(regs.r[F2DECODE(op)]);
+			break;
 		case EXEC0:
 		case EXEC1:
 		case EXEC2:
 		case EXEC3:
 		case EXEC4:
-			exec((reg_t *) (uintptr_t) (*ip++));
+			vm_exec((code_t *) (uintptr_t) (*ip++));
+			break;
+		case JTAB:
+			jt = (struct jump_table *) (uintptr_t) *ip++;
+			idx = regs.r[F1DECODE(op)] - jt->lo;
+			fn = idx < jt->n ? jt->target[idx] : jt->deflt;
+			ip = (code_t *) (uintptr_t) fn;
+			break;
+		case LDB:
+			p = (uint8_t *) (uintptr_t) regs.r[F2DECODE(op)];
+			regs.r[F1DECODE(op)] = p[regs.r[F3DECODE(op)]];
+			break;
+		case LDBP:
+			p = (uint8_t *) (uintptr_t) regs.r[F2DECODE(op)]++;
+			regs.r[F1DECODE(op)] = *p;
+			break;
+		case LDW:
+			wp = (reg_t *) (uintptr_t) regs.r[F2DECODE(op)];
+			regs.r[F1DECODE(op)] = wp[regs.r[F3DECODE(op)]];
+			break;
+		case LDWP:
+			wp = (reg_t *) (uintptr_t) regs.r[F2DECODE(op)];
+			regs.r[F2DECODE(op)] += sizeof(reg_t);
+			regs.r[F1DECODE(op)] = *wp;
 			break;
 		case MOV:
 			regs.r[F1DECODE(op)] = regs.r[F2DECODE(op)];
@@ -520,29 +879,133 @@ void exec(reg_t *ip)
 		case MOVHI:
 			regs.r[F1DECODE(op)] |= (F23DECODE(op) << 16);
 			break;
-		case POP:
+		case MOVLIT:
+			memcpy(&regs.r[F1DECODE(op)], ip, sizeof(reg_t));
+			ip += sizeof(reg_t) / sizeof(*ip);
+			break;
+		case POPCNT:
+			regs.r[F1DECODE(op)] = reg_popcnt(regs.r[F2DECODE(op)]);
+			break;
+		case POPM:
+			// highest register first, undoing PUSHM
 			sp = (reg_t *) (uintptr_t) regs.sp;
-			regs.r[F1DECODE(op)] = *sp++;
+			for (unsigned mask = F3DECODE(op); mask;) {
+				int i = 31 - __builtin_clz(mask);
+
+				regs.r[i] = *sp++;
+				mask &= ~(1u << i);
+			}
 			regs.sp = (reg_t) (uintptr_t) sp;
 			break;
-		case PUSH:
+		case PROFIN:
+			profile_enter((struct profile *) (uintptr_t) *ip++);
+			break;
+		case PROFOUT:
+			profile_exit((struct profile *) (uintptr_t) *ip++);
+			break;
+		case PUSHM:
 			sp = (reg_t *) (uintptr_t) regs.sp;
-			*--sp = regs.r[F1DECODE(op)];
+			for (unsigned mask = F3DECODE(op); mask; mask &= mask - 1)
+				*--sp = regs.r[__builtin_ctz(mask)];
 			regs.sp = (reg_t) (uintptr_t) sp;
 			break;
 		case RET:
 			return;
+		case ROL:
+			regs.r[F1DECODE(op)] = reg_rol(regs.r[F2DECODE(op)],
+						       regs.r[F3DECODE(op)]);
+			break;
+		case ROR:
+			regs.r[F1DECODE(op)] = reg_ror(regs.r[F2DECODE(op)],
+						       regs.r[F3DECODE(op)]);
+			break;
+		case STB:
+			p = (uint8_t *) (uintptr_t) regs.r[F2DECODE(op)];
+			p[regs.r[F3DECODE(op)]] = regs.r[F1DECODE(op)];
+			break;
+		case STBP:
+			p = (uint8_t *) (uintptr_t) regs.r[F2DECODE(op)];
+			*p = regs.r[F1DECODE(op)];
+			regs.r[F2DECODE(op)]++;
+			break;
+		case STW:
+			wp = (reg_t *) (uintptr_t) regs.r[F2DECODE(op)];
+			wp[regs.r[F3DECODE(op)]] = regs.r[F1DECODE(op)];
+			break;
+		case STWP:
+			wp = (reg_t *) (uintptr_t) regs.r[F2DECODE(op)];
+			*wp = regs.r[F1DECODE(op)];
+			regs.r[F2DECODE(op)] += sizeof(reg_t);
+			break;
+		case TIER:
+			target = tier_count((struct tier *) (uintptr_t) *ip++);
+			if (!target)
+				break;
+
+			// hand over to the promoted version of the word
+			if (tier_backend == &vm_backend) {
+				vm_exec(target);
+			} else {
+				tier_backend->set_regs(&regs);
+				tier_backend->exec(target);
+				regs = tier_backend->get_regs();
+			}
+			return;
 		}
 	}
 }
 
-struct regset get_regs()
+/*
+ * Count calls to the word (see tier.c). This is emitted before the
+ * preamble so that the promoted word can be run in place of all of it.
+ */
+static code_t *vm_assemble_tier(code_t *ip, struct tier *t)
+{
+	*ip++ = ASM_TIER();
+	*ip++ = (code_t) (uintptr_t) t;
+	return ip;
+}
+
+static struct regset vm_get_regs()
 {
 	assert(regs.zero == 0);
 	return regs;
 }
 
-void set_sp(reg_t sp)
+static void vm_set_arg(int n, reg_t val)
+{
+	regs.arg[n] = val;
+}
+
+static void vm_set_regs(const struct regset *r)
+{
+	regs = *r;
+}
+
+static void vm_set_sp(reg_t sp)
 {
 	regs.sp = sp;
 }
+
+const struct backend vm_backend = {
+	.name = "vm",
+	.assemble_word = vm_assemble_word,
+	.assemble_ret = vm_assemble_ret,
+	.assemble_preamble = vm_assemble_preamble,
+	.assemble_postamble = vm_assemble_postamble,
+	.assemble_if = vm_assemble_if,
+	.assemble_else = vm_assemble_else,
+	.assemble_while = vm_assemble_while,
+	.assemble_endwhile = vm_assemble_endwhile,
+	.assemble_tier = vm_assemble_tier,
+	.assemble_jump = vm_assemble_jump,
+	.assemble_branch_imm = vm_assemble_branch_imm,
+	.assemble_jump_table = vm_assemble_jump_table,
+	.fixup_if = vm_fixup_if,
+	.disassemble = vm_disassemble,
+	.exec = vm_exec,
+	.get_regs = vm_get_regs,
+	.set_arg = vm_set_arg,
+	.set_regs = vm_set_regs,
+	.set_sp = vm_set_sp,
+};